@@ -0,0 +1,70 @@
+#ifndef AJC_HGUARD_BOUNDED_QUEUE
+#define AJC_HGUARD_BOUNDED_QUEUE
+
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+
+/* BoundedQueue<T>
+ *
+ * A blocking FIFO with a fixed capacity, for handing work from producer
+ * threads to consumer threads (e.g. chorales from a parser to training). push
+ * blocks while the queue is full, so a fast producer can't run arbitrarily far
+ * ahead of the consumers.
+ *
+ * Once the queue is closed, pushes fail (so a producer can notice that the
+ * consumers have given up) and pops fail as soon as the queue is empty (so the
+ * consumers can tell that the producers have finished). */
+template<class T>
+class BoundedQueue {
+  std::queue<T> items;
+  const size_t capacity;
+  bool closed;
+  std::mutex mutex;
+  std::condition_variable not_full;
+  std::condition_variable not_empty;
+
+public:
+  explicit BoundedQueue(size_t cap) : capacity(cap), closed(false) {}
+
+  BoundedQueue(const BoundedQueue &) = delete;
+  BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+  // returns false (dropping the item) if the queue has been closed
+  bool push(T item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_full.wait(lock, [this]() { return closed || items.size() < capacity; });
+    if (closed)
+      return false;
+
+    items.push(std::move(item));
+    lock.unlock();
+    not_empty.notify_one();
+    return true;
+  }
+
+  // returns false once the queue is closed and there is nothing left in it
+  bool pop(T &item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_empty.wait(lock, [this]() { return closed || !items.empty(); });
+    if (items.empty())
+      return false;
+
+    item = std::move(items.front());
+    items.pop();
+    lock.unlock();
+    not_full.notify_one();
+    return true;
+  }
+
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      closed = true;
+    }
+    not_full.notify_all();
+    not_empty.notify_all();
+  }
+};
+
+#endif
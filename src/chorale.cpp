@@ -1,5 +1,7 @@
 #include "chorale.hpp"
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 
 // convenience macros for LaTeX trie generation
@@ -222,82 +224,152 @@ std::ostream& operator<<(std::ostream &os, const ChoraleTimeSig &ts) {
  * ChoraleEvent implementation: reification for derived types
  *************************************************************/
 
-EventDistribution<ChoralePitch>
-ChoraleEvent::reify(
-  const std::vector<ChoraleEvent> &ctx,
-  const EventDistribution<ChoraleIntref> &intref_dist
-) {
-  if (ctx.empty()) {
-    const std::string msg = "Need context to predict with intref viewpoint";
-    throw ViewpointPredictionException(msg);
+/* Reification tables
+ *
+ * The pitch predicted by a seqint only depends on the last pitch, and the
+ * pitches predicted by an intref only depend on the referent of the key
+ * signature. We tabulate these mappings the first time they are needed, so that
+ * reifying a distribution is just a gather followed by (at most) one
+ * normalisation. The tables are visited in the same order as the loops they
+ * replace, so the resulting distributions are identical. */
+namespace {
+
+struct SeqintTable {
+  constexpr static unsigned int no_pitch = ChoralePitch::cardinality;
+
+  // target[p][i]: the code of pitch p transposed by interval i (or no_pitch)
+  std::array<std::array<unsigned int, ChoraleInterval::cardinality>,
+    ChoralePitch::cardinality> target;
+
+  // whether every interval gives a valid pitch from pitch p
+  std::array<bool, ChoralePitch::cardinality> all_valid;
+
+  SeqintTable() {
+    for (auto pitch : EventEnumerator<ChoralePitch>()) {
+      unsigned int valid = 0;
+      for (auto interval : EventEnumerator<ChoraleInterval>()) {
+        auto midi_interval = interval.midi_interval();
+        auto &t = target[pitch.encode()][interval.encode()];
+        if (pitch.is_valid_transposition(midi_interval)) {
+          t = (pitch + midi_interval).encode();
+          valid++;
+        }
+        else
+          t = no_pitch;
+      }
+      all_valid[pitch.encode()] = (valid == ChoraleInterval::cardinality);
+    }
   }
+};
 
-  auto ks = ctx.front().project<ChoraleKeySig>();
-  auto referent = ks.referent();
+struct IntrefTable {
+  struct Entry {
+    unsigned int intref;
+    unsigned int pitch;
+  };
+
+  // each intref can give at most three pitches (one per base octave)
+  constexpr static unsigned int max_entries = 3 * ChoraleIntref::cardinality;
+
+  // indexed by the MIDI pitch class of the referent
+  std::array<std::array<Entry, max_entries>, 12> entries;
+  std::array<unsigned int, 12> num_entries;
+
+  IntrefTable() {
+    std::array<MidiPitch, 3> base_pitches{{ 48,60,72 }};
+    for (unsigned int referent = 0; referent < 12; referent++) {
+      unsigned int n = 0;
+      for (auto intref : EventEnumerator<ChoraleIntref>()) {
+        for (auto base : base_pitches) {
+          MidiPitch transposed(base.pitch + referent + intref.encode());
+          if (!ChoralePitch::is_valid_pitch(transposed))
+            continue;
+
+          entries[referent][n++] = 
+            { intref.encode(), ChoralePitch(transposed).encode() };
+        }
+      }
+      num_entries[referent] = n;
+    }
+  }
+};
 
-  std::array<double, ChoralePitch::cardinality> new_values{{0.0}};
-  double total_probability = 0.0;
+const SeqintTable &seqint_table() {
+  static const SeqintTable table;
+  return table;
+}
 
-  std::array<MidiPitch, 3> base_pitches{{ 48,60,72 }};
+const IntrefTable &intref_table() {
+  static const IntrefTable table;
+  return table;
+}
 
-  for (auto intref : EventEnumerator<ChoraleIntref>()) {
-    for (auto base : base_pitches) {
-      MidiPitch transposed(base.pitch + referent.pitch + intref.encode());
+} // anonymous namespace
 
-      if (!ChoralePitch::is_valid_pitch(transposed))
-        continue;
+Prediction<ChoralePitch>
+ChoraleEvent::reify(
+  const ChoraleFeatures &ctx,
+  const EventDistribution<ChoraleIntref> &intref_dist
+) {
+  // need the key signature of the piece
+  if (ctx.empty())
+    return Prediction<ChoralePitch>();
 
-      ChoralePitch candidate_pitch(transposed);
+  const auto referent = ctx.referent_pitch().pitch;
+  assert(referent < 12);
 
-      auto prob = intref_dist.probability_for(intref);
-      new_values[candidate_pitch.encode()] += prob;
-      total_probability += prob;
-    }
+  const auto &table = intref_table();
+  const auto &entries = table.entries[referent];
+  const auto n = table.num_entries[referent];
+
+  std::array<double, ChoralePitch::cardinality> new_values{{0.0}};
+  double total_probability = 0.0;
+
+  for (unsigned int i = 0; i < n; i++) {
+    auto prob = intref_dist.probability_for_code(entries[i].intref);
+    new_values[entries[i].pitch] += prob;
+    total_probability += prob;
   }
 
   // normalise
   for (auto &v : new_values)
     v /= total_probability;
 
-  return new_values;
+  return EventDistribution<ChoralePitch>(new_values);
 }
 
-EventDistribution<ChoralePitch>
+Prediction<ChoralePitch>
 ChoraleEvent::reify(
-  const std::vector<ChoraleEvent> &ctx, 
+  const ChoraleFeatures &ctx, 
   const EventDistribution<ChoraleInterval> &seqint_dist
 ) {
-  if (ctx.empty()) {
-    const std::string msg = 
-      "Seqint needs at least one pitch to predict further pitches";
-    throw ViewpointPredictionException(msg);
-  }
+  // need at least one pitch to predict further pitches
+  if (ctx.empty())
+    return Prediction<ChoralePitch>();
 
-  auto last_pitch = ctx.back().project<ChoralePitch>();
-  std::array<double, ChoralePitch::cardinality> new_values{{0.0}};
+  const auto &table = seqint_table();
+  const auto last_pitch = ctx.last_pitch().encode();
+  const auto &targets = table.target[last_pitch];
 
+  std::array<double, ChoralePitch::cardinality> new_values{{0.0}};
   double total_probability = 0.0;
-  unsigned int valid_predictions = 0;
 
-  for (auto interval : EventEnumerator<ChoraleInterval>()) { 
-    auto midi_interval = interval.midi_interval();
-    if (!last_pitch.is_valid_transposition(midi_interval))
+  for (unsigned int i = 0; i < ChoraleInterval::cardinality; i++) {
+    if (targets[i] == SeqintTable::no_pitch)
       continue;
 
-    auto candidate_pitch = last_pitch + midi_interval;
-    auto prob = seqint_dist.probability_for(interval);
-    new_values[candidate_pitch.encode()] = prob;
+    auto prob = seqint_dist.probability_for_code(i);
+    new_values[targets[i]] = prob;
     total_probability += prob;
-    valid_predictions++;
   }
 
-  if (valid_predictions == ChoraleInterval::cardinality)
-    return new_values;
+  if (table.all_valid[last_pitch])
+    return EventDistribution<ChoralePitch>(new_values);
 
   for (auto &v : new_values)
     v /= total_probability;
 
-  return new_values;
+  return EventDistribution<ChoralePitch>(new_values);
 }
 
 /********************************************************************
@@ -316,6 +388,11 @@ ChoraleInterval::ChoraleInterval(const MidiInterval &ival) :
   assert(dp != -11 && dp != -10 && dp != 11);
 }
 
+bool ChoraleInterval::is_valid_interval(const MidiInterval &ival) {
+  auto dp = ival.delta_pitch;
+  return dp == -12 || dp == 12 || (-9 <= dp && dp <= 10);
+}
+
 const std::array<std::string, 13> ChoraleInterval::interval_strings = {{
   "Z", "m2", "M2", "m3", "M3", "P4", "Tri", "P5", "m6", "M6", "m7", "M7", "8ve"
 }};
@@ -351,6 +428,92 @@ unsigned int ChoraleIOI::map_out(unsigned int c) {
   return ioi_domain[c];
 }
 
+bool ChoraleIOI::is_valid_ioi(unsigned int dur) {
+  for (auto d : ioi_domain)
+    if (d == dur)
+      return true;
+
+  return false;
+}
+
+/********************************************************************
+ * ChoraleFeatures implementation
+ ********************************************************************/
+
+ChoraleFeatures::ChoraleFeatures() :
+  referent(0), bar_length(0), offset(0), bad_interval(0), bad_ioi(0) {}
+
+ChoraleFeatures::ChoraleFeatures(const std::vector<ChoraleEvent> &es) :
+  ChoraleFeatures() {
+  for (const auto &e : es)
+    push_back(e);
+}
+
+void ChoraleFeatures::clear() {
+  *this = ChoraleFeatures();
+}
+
+void ChoraleFeatures::truncate(const Checkpoint &cp) {
+  assert(cp.size <= size());
+  assert(cp.num_seqints <= seqints.size() && cp.num_iois <= iois.size());
+
+  // the referent and bar length can stay: they are reset by the next push if
+  // nothing is kept, and are unchanged otherwise
+  // (events aren't assignable, so they can't be erased, only popped)
+  while (event_buf.size() > cp.size)
+    event_buf.pop_back();
+  for (auto col : { &keysigs, &timesigs, &pitches, &durations, &rests,
+                    &intrefs, &posinbars, &fibs, &fips })
+    col->resize(cp.size);
+  seqints.resize(cp.num_seqints);
+  iois.resize(cp.num_iois);
+
+  offset = cp.offset;
+  bad_interval = cp.bad_interval;
+  bad_ioi = cp.bad_ioi;
+}
+
+void ChoraleFeatures::push_back(const ChoraleEvent &e) {
+  // the referent and bar length are taken from the first event of the piece
+  // (c.f. ChoraleEvent::lift)
+  if (event_buf.empty()) {
+    referent = e.keysig.referent().pitch;
+    bar_length = e.timesig.raw_value();
+  }
+  else {
+    const auto &prev = event_buf.back();
+
+    // first-order types are only defined from the second event onwards
+    auto delta = e.pitch - prev.pitch;
+    if (bad_interval == 0 && !ChoraleInterval::is_valid_interval(delta))
+      bad_interval = delta.delta_pitch;
+    if (bad_interval == 0)
+      seqints.push_back(ChoraleInterval(delta).encode());
+
+    auto ioi_amt = e.rest.raw_value() + prev.duration.raw_value();
+    if (bad_ioi == 0 && !ChoraleIOI::is_valid_ioi(ioi_amt))
+      bad_ioi = ioi_amt;
+    if (bad_ioi == 0)
+      iois.push_back(ChoraleIOI(QuantizedDuration(ioi_amt)).encode());
+  }
+
+  keysigs.push_back(e.keysig.encode());
+  timesigs.push_back(e.timesig.encode());
+  pitches.push_back(e.pitch.encode());
+  durations.push_back(e.duration.encode());
+  rests.push_back(e.rest.encode());
+
+  intrefs.push_back((e.pitch.raw_value() - referent) % 12);
+
+  offset += e.rest.raw_value();
+  posinbars.push_back(offset % bar_length);
+  fibs.push_back((offset % bar_length) == 0);
+  fips.push_back(event_buf.empty());
+  offset += e.duration.raw_value();
+
+  event_buf.push_back(e);
+}
+
 /********************************************************************
  * Viewpoint implementations below
  ********************************************************************/
@@ -483,7 +646,22 @@ IntrefViewpoint::predict(const std::vector<ChoraleEvent> &ctx) const {
 // (and further generalise multiple viewpoint systems in C++ rather than the
 // specific chorale case) but this is not a priority
 
+ChoraleVPLayer::ChoraleVPLayer(const ChoraleVPLayer &other) :
+  pool(other.pool), parallel_threshold(other.parallel_threshold),
+  entropy_bias(other.entropy_bias), vp_history(other.vp_history) {
+  for (const auto &vp_ptr : other.predictors<ChoralePitch>())
+    pitch_predictors.emplace_back(vp_ptr->clone());
+  for (const auto &vp_ptr : other.predictors<ChoraleDuration>())
+    duration_predictors.emplace_back(vp_ptr->clone());
+  for (const auto &vp_ptr : other.predictors<ChoraleRest>())
+    rest_predictors.emplace_back(vp_ptr->clone());
+}
+
 void ChoraleVPLayer::learn(const std::vector<ChoraleEvent> &seq) {
+  learn(ChoraleFeatures(seq));
+}
+
+void ChoraleVPLayer::learn(const ChoraleFeatures &seq) {
   for (auto &vp_ptr : predictors<ChoralePitch>())
     vp_ptr->learn(seq);
   for (auto &vp_ptr : predictors<ChoraleDuration>())
@@ -492,7 +670,24 @@ void ChoraleVPLayer::learn(const std::vector<ChoraleEvent> &seq) {
     vp_ptr->learn(seq);
 }
 
+void ChoraleVPLayer::unlearn(const std::vector<ChoraleEvent> &seq) {
+  unlearn(ChoraleFeatures(seq));
+}
+
+void ChoraleVPLayer::unlearn(const ChoraleFeatures &seq) {
+  for (auto &vp_ptr : predictors<ChoralePitch>())
+    vp_ptr->unlearn(seq);
+  for (auto &vp_ptr : predictors<ChoraleDuration>())
+    vp_ptr->unlearn(seq);
+  for (auto &vp_ptr : predictors<ChoraleRest>())
+    vp_ptr->unlearn(seq);
+}
+
 void ChoraleVPLayer::learn_from_tail(const std::vector<ChoraleEvent> &seq) {
+  learn_from_tail(ChoraleFeatures(seq));
+}
+
+void ChoraleVPLayer::learn_from_tail(const ChoraleFeatures &seq) {
   for (auto &vp_ptr : predictors<ChoralePitch>())
     vp_ptr->learn_from_tail(seq);
   for (auto &vp_ptr : predictors<ChoraleDuration>())
@@ -501,6 +696,42 @@ void ChoraleVPLayer::learn_from_tail(const std::vector<ChoraleEvent> &seq) {
     vp_ptr->learn_from_tail(seq);
 }
 
+ChoraleVPLayer::Cursors ChoraleVPLayer::make_cursors() const {
+  Cursors result;
+  for (const auto &vp_ptr : predictors<ChoralePitch>())
+    result.pitch.push_back(vp_ptr->make_cursor());
+  for (const auto &vp_ptr : predictors<ChoraleDuration>())
+    result.duration.push_back(vp_ptr->make_cursor());
+  for (const auto &vp_ptr : predictors<ChoraleRest>())
+    result.rest.push_back(vp_ptr->make_cursor());
+  return result;
+}
+
+void ChoraleVPLayer::set_cache_capacity(size_t capacity) {
+  for (auto &vp_ptr : predictors<ChoralePitch>())
+    vp_ptr->set_cache_capacity(capacity);
+  for (auto &vp_ptr : predictors<ChoraleDuration>())
+    vp_ptr->set_cache_capacity(capacity);
+  for (auto &vp_ptr : predictors<ChoraleRest>())
+    vp_ptr->set_cache_capacity(capacity);
+}
+
+SuccessorCacheStats ChoraleVPLayer::cache_stats() const {
+  SuccessorCacheStats total{0, 0};
+  auto add = [&total](const SuccessorCacheStats &stats) {
+    total.hits += stats.hits;
+    total.misses += stats.misses;
+  };
+
+  for (const auto &vp_ptr : predictors<ChoralePitch>())
+    add(vp_ptr->cache_stats());
+  for (const auto &vp_ptr : predictors<ChoraleDuration>())
+    add(vp_ptr->cache_stats());
+  for (const auto &vp_ptr : predictors<ChoraleRest>())
+    add(vp_ptr->cache_stats());
+  return total;
+}
+
 void ChoraleVPLayer::reset_viewpoints() {
   for (auto &vp_ptr : predictors<ChoralePitch>())
     vp_ptr->reset();
@@ -510,33 +741,486 @@ void ChoraleVPLayer::reset_viewpoints() {
     vp_ptr->reset();
 }
 
+ChoraleVPLayer::Checkpoint ChoraleVPLayer::checkpoint() {
+  Checkpoint marks;
+  for (auto &vp_ptr : predictors<ChoralePitch>())
+    marks.push_back(vp_ptr->checkpoint());
+  for (auto &vp_ptr : predictors<ChoraleDuration>())
+    marks.push_back(vp_ptr->checkpoint());
+  for (auto &vp_ptr : predictors<ChoraleRest>())
+    marks.push_back(vp_ptr->checkpoint());
+  return marks;
+}
+
+void ChoraleVPLayer::rollback(const Checkpoint &marks) {
+  auto mark = marks.begin();
+  for (auto &vp_ptr : predictors<ChoralePitch>())
+    vp_ptr->rollback(*mark++);
+  for (auto &vp_ptr : predictors<ChoraleDuration>())
+    vp_ptr->rollback(*mark++);
+  for (auto &vp_ptr : predictors<ChoraleRest>())
+    vp_ptr->rollback(*mark++);
+  assert(mark == marks.end());
+}
+
+void ChoraleVPLayer::release_checkpoints() {
+  for (auto &vp_ptr : predictors<ChoralePitch>())
+    vp_ptr->release_checkpoints();
+  for (auto &vp_ptr : predictors<ChoraleDuration>())
+    vp_ptr->release_checkpoints();
+  for (auto &vp_ptr : predictors<ChoraleRest>())
+    vp_ptr->release_checkpoints();
+}
+
+template<class GetPiece>
+std::vector<ChoraleEntropies> ChoraleMVS::corpus_entropies_with(
+  size_t num_pieces, const GetPiece &get_piece, ThreadPool &pool
+) const {
+  std::vector<ChoraleEntropies> result(num_pieces);
+  if (num_pieces == 0)
+    return result;
+
+  // one short-term layer per worker (the calling thread also does work). the
+  // short-term layer is reset at the start of each piece, so it doesn't matter
+  // which worker evaluates which piece.
+  const size_t num_workers = std::min<size_t>(pool.size() + 1, num_pieces);
+  std::vector<ChoraleVPLayer> st_layers(num_workers, short_term_layer);
+
+  std::atomic<size_t> next_piece(0);
+  pool.parallel_for(num_workers, [&](size_t w) {
+    for (size_t i = next_piece++; i < num_pieces; i = next_piece++)
+      result[i] = sequence_entropies(get_piece(i), st_layers[w]);
+  });
+
+  return result;
+}
+
+std::vector<ChoraleEntropies> ChoraleMVS::corpus_entropies(
+  const std::vector<std::vector<ChoraleEvent>> &corpus,
+  ThreadPool &pool
+) const {
+  return corpus_entropies_with(corpus.size(),
+    [&corpus](size_t i) -> const std::vector<ChoraleEvent> & { 
+      return corpus[i]; 
+    }, pool);
+}
+
+std::vector<ChoraleEntropies> ChoraleMVS::corpus_entropies(
+  size_t num_pieces,
+  const std::function<std::vector<ChoraleEvent>(size_t)> &get_piece,
+  ThreadPool &pool
+) const {
+  return corpus_entropies_with(num_pieces, get_piece, pool);
+}
+
+GeneratedChorale ChoraleMVS::sample_with(Session &session, unsigned int len,
+                                         const EventDrawer &draw) const {
+  assert(len > 0);
+
+  GeneratedChorale result;
+  result.entropies = {0.0, 0.0, 0.0};
+  result.attempts = 1;
+  result.accepted = true;
+
+  // events which the viewpoints can't represent (e.g. a note and rest too
+  // long for an IOI) are taken back and drawn again, up to this many times
+  const unsigned int max_redraws = 100;
+
+  auto dists = session.next_all();
+  for (unsigned int i = 0; i < len; i++) {
+    const auto current = dists;
+    for (unsigned int redraws = 0; ; redraws++) {
+      auto event = draw(i, current);
+      auto cp = session.checkpoint();
+      try {
+        session.push(event);
+        if (i + 1 < len)
+          dists = session.next_all();
+      }
+      catch (const ChoraleTypeError &) {
+        if (redraws == max_redraws)
+          throw;
+        session.rollback(cp);
+        continue;
+      }
+
+      // the event stays, so the short-term models needn't log its counts
+      session.release_checkpoints();
+      result.entropies.pitch -= 
+        std::log2(current.pitch.probability_for(event.pitch));
+      result.entropies.duration -= 
+        std::log2(current.duration.probability_for(event.duration));
+      result.entropies.rest -= 
+        std::log2(current.rest.probability_for(event.rest));
+      result.events.push_back(event);
+      break;
+    }
+  }
+
+  result.entropies.pitch /= len;
+  result.entropies.duration /= len;
+  result.entropies.rest /= len;
+  return result;
+}
+
+GeneratedChorale ChoraleMVS::sample_piece(
+  Session &session, unsigned int len, const QuantizedDuration &timesig,
+  RandomSource *rs, const SamplingConfig &sampling
+) const {
+  session.reset();
+  auto keysig = key_distribution.predict(session.features())
+                                .sample_with_source(rs);
+  ChoralePitch tonic(MidiPitch(60 + keysig.referent().pitch));
+
+  return sample_with(session, len, 
+    [&](unsigned int i, const ChoralePredictions &dists) {
+      // as in random_walk, start on the tonic
+      auto pitch = (i == 0) ? tonic :
+        sampling.truncate(dists.pitch).sample_with_source(rs);
+      auto dur  = sampling.truncate(dists.duration).sample_with_source(rs);
+      auto rest = sampling.truncate(dists.rest).sample_with_source(rs);
+      return ChoraleEvent(keysig, timesig, pitch, dur, rest);
+    });
+}
+
+EventMask<ChoralePitch> GenerationConstraints::pitches_where(
+  const std::function<bool(unsigned int)> &allow
+) {
+  EventMask<ChoralePitch> mask;
+  for (unsigned int c = 0; c < ChoralePitch::cardinality; c++)
+    mask[c] = allow(ChoralePitch(c).raw_value());
+  return mask;
+}
+
+GeneratedChorale ChoraleMVS::sample_constrained(
+  Session &session, const ChoraleKeySig &keysig,
+  const QuantizedDuration &timesig, const GenerationConstraints &constraints,
+  RandomSource *rs, const SamplingConfig &sampling
+) const {
+  const auto &steps = constraints.steps;
+  const unsigned int len = steps.size();
+  const unsigned int total = constraints.total_duration;
+
+  for (unsigned int i = 0; i < len; i++) {
+    if (steps[i].pitch.none() || steps[i].duration.none() || 
+        steps[i].rest.none())
+      throw ConstraintError("Nothing allowed at step " + std::to_string(i));
+  }
+
+  // reachable[i][t] says whether steps i onwards can add up to exactly t
+  std::vector<std::vector<char>> reachable;
+  if (total > 0) {
+    reachable.assign(len + 1, std::vector<char>(total + 1, 0));
+    reachable[len][0] = 1;
+    for (unsigned int i = len; i-- > 0; ) {
+      for (unsigned int d = 0; d < ChoraleDuration::cardinality; d++) {
+        for (unsigned int r = 0; r < ChoraleRest::cardinality; r++) {
+          if (!steps[i].duration[d] || !steps[i].rest[r])
+            continue;
+
+          auto amount = ChoraleDuration(d).raw_value() + 
+                        ChoraleRest(r).raw_value();
+          for (unsigned int t = amount; t <= total; t++)
+            if (reachable[i+1][t - amount])
+              reachable[i][t] = 1;
+        }
+      }
+    }
+
+    if (!reachable[0][total])
+      throw ConstraintError("Can't make up a total duration of " + 
+                            std::to_string(total));
+  }
+
+  session.reset();
+  return sample_with(session, len,
+    [&](unsigned int i, const ChoralePredictions &dists) {
+      const auto &step = steps[i];
+
+      // whether the rest of the piece can still make up the total after an
+      // event taking up the given amount of time
+      const unsigned int remaining = total - session.features().end_offset();
+      auto fits = [&](unsigned int amount) {
+        return amount <= remaining && reachable[i+1][remaining - amount];
+      };
+
+      // durations are drawn first, from those which leave room for some rest
+      auto durations = step.duration;
+      if (total > 0) {
+        for (unsigned int d = 0; d < ChoraleDuration::cardinality; d++) {
+          auto dur_amount = ChoraleDuration(d).raw_value();
+          bool any_rest = false;
+          for (unsigned int r = 0; r < ChoraleRest::cardinality; r++) {
+            any_rest = any_rest || 
+              (step.rest[r] && fits(dur_amount + ChoraleRest(r).raw_value()));
+          }
+          durations[d] = durations[d] && any_rest;
+        }
+      }
+
+      auto pitch = sampling.truncate(dists.pitch.masked(step.pitch))
+                           .sample_with_source(rs);
+      auto dur = sampling.truncate(dists.duration.masked(durations))
+                         .sample_with_source(rs);
+
+      auto rests = step.rest;
+      if (total > 0) {
+        for (unsigned int r = 0; r < ChoraleRest::cardinality; r++)
+          rests[r] = rests[r] && 
+            fits(dur.raw_value() + ChoraleRest(r).raw_value());
+      }
+
+      auto rest = sampling.truncate(dists.rest.masked(rests))
+                          .sample_with_source(rs);
+      return ChoraleEvent(keysig, timesig, pitch, dur, rest);
+    });
+}
+
+std::vector<GeneratedChorale> ChoraleMVS::sample_batch(
+  size_t num_pieces, const PieceGenerator &generate,
+  const std::function<bool(const ChoraleEntropies &)> &accept,
+  unsigned int max_attempts, xoroshiro128plus_engine engine, ThreadPool &pool
+) const {
+  assert(max_attempts > 0);
+
+  std::vector<xoroshiro128plus_engine> streams;
+  for (size_t i = 0; i < num_pieces; i++) {
+    streams.push_back(engine);
+    engine.jump();
+  }
+
+  std::vector<GeneratedChorale> result(num_pieces);
+  if (num_pieces == 0)
+    return result;
+
+  const size_t num_workers = std::min<size_t>(pool.size() + 1, num_pieces);
+  std::atomic<size_t> next_piece(0);
+  pool.parallel_for(num_workers, [&](size_t) {
+    Session session(*this);
+    for (size_t i = next_piece++; i < num_pieces; i = next_piece++) {
+      DefaultRandomSource rs(streams[i]);
+      result[i] = {{}, {0.0, 0.0, 0.0}, 0, false};
+      for (unsigned int attempts = 1; attempts <= max_attempts; attempts++) {
+        try {
+          result[i] = generate(session, &rs);
+        }
+        catch (const ChoraleTypeError &) {
+          // sample_with couldn't find an event which the viewpoints can
+          // represent
+          result[i].attempts = attempts;
+          continue;
+        }
+
+        result[i].attempts = attempts;
+        result[i].accepted = accept(result[i].entropies);
+        if (result[i].accepted)
+          break;
+      }
+    }
+  });
+
+  return result;
+}
+
+std::vector<GeneratedChorale> ChoraleMVS::sample_pieces(
+  size_t num_pieces, unsigned int len, const QuantizedDuration &timesig,
+  const std::function<bool(const ChoraleEntropies &)> &accept,
+  unsigned int max_attempts, xoroshiro128plus_engine engine, ThreadPool &pool,
+  const SamplingConfig &sampling
+) const {
+  return sample_batch(num_pieces, 
+    [&](Session &session, RandomSource *rs) {
+      return sample_piece(session, len, timesig, rs, sampling);
+    }, accept, max_attempts, engine, pool);
+}
+
+std::vector<GeneratedChorale> ChoraleMVS::sample_constrained_pieces(
+  size_t num_pieces, const ChoraleKeySig &keysig,
+  const QuantizedDuration &timesig, const GenerationConstraints &constraints,
+  const std::function<bool(const ChoraleEntropies &)> &accept,
+  unsigned int max_attempts, xoroshiro128plus_engine engine, ThreadPool &pool,
+  const SamplingConfig &sampling
+) const {
+  return sample_batch(num_pieces,
+    [&](Session &session, RandomSource *rs) {
+      return sample_constrained(session, keysig, timesig, constraints, 
+                                rs, sampling);
+    }, accept, max_attempts, engine, pool);
+}
+
+std::vector<GeneratedChorale> ChoraleMVS::beam_search(
+  unsigned int len, const QuantizedDuration &timesig,
+  const ChoraleKeySig &keysig, unsigned int beam_width
+) const {
+  assert(len > 0 && beam_width > 0);
+
+  // a partial piece, with the session it has been fed to and the predictions
+  // for its next event. the entropies are running totals until the end.
+  struct Beam {
+    Session session;
+    GeneratedChorale piece;
+    double cost; // total information content (bits)
+    ChoralePredictions next;
+  };
+
+  // an extension of a beam by one event, given by its codes
+  struct Candidate {
+    double cost;
+    size_t parent;
+    unsigned int pitch;
+    unsigned int duration;
+    unsigned int rest;
+  };
+
+  std::vector<Beam> beams;
+  beams.push_back({ Session(*this), {{}, {0.0, 0.0, 0.0}, 1, true}, 0.0, {} });
+  beams.front().next = beams.front().session.next_all();
+
+  ChoralePitch tonic(MidiPitch(60 + keysig.referent().pitch));
+
+  for (unsigned int i = 0; i < len; i++) {
+    // the types are predicted independently, so the best beam_width
+    // extensions of a beam only use its beam_width most probable pitches,
+    // durations and rests
+    std::vector<Candidate> candidates;
+    for (size_t b = 0; b < beams.size(); b++) {
+      const auto &next = beams[b].next;
+      auto pitches = (i == 0) ? std::vector<ChoralePitch>{ tonic } :
+                                next.pitch.most_probable(beam_width);
+      auto durations = next.duration.most_probable(beam_width);
+      auto rests = next.rest.most_probable(beam_width);
+
+      for (const auto &p : pitches) {
+        double p_cost = -std::log2(next.pitch.probability_for(p));
+        for (const auto &d : durations) {
+          double d_cost = -std::log2(next.duration.probability_for(d));
+          for (const auto &r : rests) {
+            double r_cost = -std::log2(next.rest.probability_for(r));
+            candidates.push_back({ 
+              beams[b].cost + p_cost + d_cost + r_cost, b, 
+              p.encode(), d.encode(), r.encode()
+            });
+          }
+        }
+      }
+    }
+
+    // candidates were generated in a fixed order, so a stable sort breaks
+    // ties deterministically
+    std::stable_sort(candidates.begin(), candidates.end(),
+      [](const Candidate &x, const Candidate &y) { return x.cost < y.cost; });
+
+    auto event_for = [&](const Candidate &c) {
+      return ChoraleEvent(keysig, timesig, ChoralePitch(c.pitch),
+        ChoraleDuration(c.duration), ChoraleRest(c.rest));
+    };
+
+    // the best candidates are tried out in their parents' sessions and taken
+    // back again (see Session::checkpoint), until the beam is full of ones
+    // which the viewpoints can represent
+    struct Survivor {
+      Candidate candidate;
+      ChoralePredictions next;
+    };
+    std::vector<Survivor> survivors;
+    std::vector<unsigned int> num_children(beams.size(), 0);
+    for (const auto &c : candidates) {
+      if (survivors.size() == beam_width)
+        break;
+
+      auto &session = beams[c.parent].session;
+      auto cp = session.checkpoint();
+      ChoralePredictions next;
+      try {
+        session.push(event_for(c));
+        if (i + 1 < len)
+          next = session.next_all();
+      }
+      catch (const ChoraleTypeError &) {
+        session.rollback(cp);
+        continue; // (see sample_with)
+      }
+      session.rollback(cp);
+
+      survivors.push_back({ c, std::move(next) });
+      num_children[c.parent]++;
+    }
+
+    if (survivors.empty())
+      throw ChoraleTypeError("No continuation of the beam can be represented");
+
+    for (auto &beam : beams)
+      beam.session.release_checkpoints();
+
+    // only survivors which share a parent need their own copies of its
+    // session: the last one takes it over
+    std::vector<Beam> extended;
+    extended.reserve(survivors.size());
+    for (auto &s : survivors) {
+      const auto &c = s.candidate;
+      auto &parent = beams[c.parent];
+      Beam child = (--num_children[c.parent] == 0) ? 
+        Beam{ std::move(parent.session), std::move(parent.piece), 
+              parent.cost, {} } :
+        Beam{ parent.session, parent.piece, parent.cost, {} };
+
+      child.piece.entropies.pitch -= 
+        std::log2(parent.next.pitch.probability_for_code(c.pitch));
+      child.piece.entropies.duration -= 
+        std::log2(parent.next.duration.probability_for_code(c.duration));
+      child.piece.entropies.rest -= 
+        std::log2(parent.next.rest.probability_for_code(c.rest));
+      child.cost = c.cost;
+
+      auto event = event_for(c);
+      child.session.push(event);
+      child.piece.events.push_back(event);
+      child.next = std::move(s.next);
+      extended.push_back(std::move(child));
+    }
+
+    beams = std::move(extended);
+  }
+
+  std::vector<GeneratedChorale> result;
+  for (auto &beam : beams) {
+    beam.piece.entropies.pitch /= len;
+    beam.piece.entropies.duration /= len;
+    beam.piece.entropies.rest /= len;
+    result.push_back(std::move(beam.piece));
+  }
+
+  return result;
+}
+
 std::vector<ChoraleEvent> 
 ChoraleMVS::random_walk(unsigned int len, const QuantizedDuration &timesig) {
   assert(len > 1);
 
-  std::vector<ChoraleEvent> buffer;
+  ChoraleFeatures buffer;
 
-  auto keysig = key_distribution.predict({}).sample();
+  auto keysig = key_distribution.predict(buffer).sample();
 
   // for now just start on the tonic
   ChoralePitch first_pitch(MidiPitch(60 + keysig.referent().pitch));
 
-  auto first_dur   = predict<ChoraleDuration>({}).sample();
-  auto first_rest  = predict<ChoraleRest>({}).sample();
+  auto first_dur   = predict<ChoraleDuration>(buffer).sample();
+  auto first_rest  = predict<ChoraleRest>(buffer).sample();
 
   ChoraleEvent first_event(keysig, timesig, first_pitch, first_dur, first_rest);
   buffer.push_back(first_event);
   short_term_layer.learn_from_tail(buffer);
 
   for (unsigned int i = 0; i < len - 1; i++) {
-    auto pitch = predict<ChoralePitch>(buffer).sample();
-    auto dur   = predict<ChoraleDuration>(buffer).sample();
-    auto rest  = predict<ChoraleRest>(buffer).sample();
+    auto dists = predict_all(buffer);
+    auto pitch = dists.pitch.sample();
+    auto dur   = dists.duration.sample();
+    auto rest  = dists.rest.sample();
     ChoraleEvent event(keysig, timesig, pitch, dur, rest);
     buffer.push_back(event);
     short_term_layer.learn_from_tail(buffer);
   }
 
-  return buffer;
+  return buffer.events();
 }
 
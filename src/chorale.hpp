@@ -4,7 +4,10 @@
 #include "event.hpp"
 #include "viewpoint.hpp"
 #include "sequence_model.hpp"
+#include "thread_pool.hpp"
+#include "prediction_cache.hpp"
 #include <cassert>
+#include <functional>
 #include <string>
 #include <array>
 #include <map>
@@ -18,6 +21,13 @@ struct ChoraleTypeError : public std::runtime_error {
     std::runtime_error(msg) {}
 };
 
+// thrown if no piece can satisfy the constraints given for generation (see
+// ChoraleMVS::sample_constrained)
+struct ConstraintError : public std::runtime_error {
+  ConstraintError(std::string msg) :
+    std::runtime_error(msg) {}
+};
+
 /* N.B. we define these little wrapper types such as KeySig and MidiPitch to
  * overload the constructors of the Chorale event types */
 struct KeySig {
@@ -253,6 +263,10 @@ public:
   MidiInterval midi_interval() const { return MidiInterval(raw_value()); }
   std::string string_render() const override;
 
+  // the domain of intervals is not dense, so this checks whether a given
+  // interval can be represented as a ChoraleInterval
+  static bool is_valid_interval(const MidiInterval &delta);
+
   ChoraleInterval(const MidiInterval &delta_pitch);
   ChoraleInterval(const ChoralePitch &from, const ChoralePitch &to);
   ChoraleInterval(unsigned int code);
@@ -283,6 +297,7 @@ public:
   unsigned int encode() const override { return code; }
   unsigned int map_in(unsigned int dur);
   unsigned int map_out(unsigned int code);
+  static bool is_valid_ioi(unsigned int dur);
 
   ChoraleIOI(unsigned int c) :
     CodedEvent(c) { assert(c < cardinality); }
@@ -302,6 +317,8 @@ std::ostream& operator<<(std::ostream &os, const ChoraleTimeSig &ts);
  * ChoraleEvent declaration
  **********************************************************/
 
+class ChoraleFeatures; // see below
+
 /* This type defines the event space we use to model chorales. ChoraleEvents
  * have as members all the different types that make up a chorale event (pitch,
  * duration, offset, etc.) */
@@ -312,6 +329,9 @@ struct ChoraleEvent {
   ChoraleDuration duration;
   ChoraleRest rest;
 
+  // type used by viewpoints to cache the lifted features of a context
+  using Features = ChoraleFeatures;
+
   template<typename T>
   T project() const;
 
@@ -323,19 +343,21 @@ struct ChoraleEvent {
   static std::vector<EventPair<P,Q>>
   lift(const std::vector<ChoraleEvent> &es);
 
-  // distribution reification for basic types is the identity with an extra arg
+  // distribution reification for basic types is the identity with an extra
+  // arg. reifying derived types gives an empty prediction if the context
+  // doesn't contain enough information (e.g. there is no previous pitch).
   template<typename T>
-  static EventDistribution<T>
-  reify(const std::vector<ChoraleEvent> &, const EventDistribution<T> &dist) {
+  static Prediction<T>
+  reify(const ChoraleFeatures &, const EventDistribution<T> &dist) {
     return dist;
   }
 
-  static EventDistribution<ChoralePitch>
-  reify(const std::vector<ChoraleEvent> &ctx, 
+  static Prediction<ChoralePitch>
+  reify(const ChoraleFeatures &ctx, 
         const EventDistribution<ChoraleIntref> &intref_dist);
 
-  static EventDistribution<ChoralePitch>
-  reify(const std::vector<ChoraleEvent> &ctx,
+  static Prediction<ChoralePitch>
+  reify(const ChoraleFeatures &ctx,
         const EventDistribution<ChoraleInterval> &seqint_dist);
 
   ChoraleEvent(const KeySig &ks,
@@ -507,6 +529,148 @@ ChoraleEvent::lift(const std::vector<ChoraleEvent> &es) {
   return result;
 }
 
+/**********************************************************
+ * ChoraleFeatures: cached lifting of chorale sequences
+ **********************************************************/
+
+/* ChoraleFeatures caches the basic and derived types of a sequence of
+ * ChoraleEvents, and is maintained incrementally as events are appended.
+ *
+ * Some derived types depend on state which runs from the start of the piece
+ * (e.g. posinbar and fib need the running offset, intref needs the referent of
+ * the piece). Lifting these from scratch for every viewpoint on every
+ * prediction is wasteful, so instead we compute each of them once per event
+ * here and share the results between all viewpoints predicting from the same
+ * context.
+ *
+ * The features are stored as a struct of arrays: one column of encoded events
+ * per type. Viewpoints take views of the columns (usually just the last few
+ * events, since that is all a context model looks at) rather than lifting
+ * vectors of events themselves. */
+class ChoraleFeatures {
+public:
+  using column_t = std::vector<unsigned int>;
+
+private:
+  std::vector<ChoraleEvent> event_buf;
+
+  // basic types
+  column_t keysigs;
+  column_t timesigs;
+  column_t pitches;
+  column_t durations;
+  column_t rests;
+
+  // derived types
+  column_t seqints;
+  column_t intrefs;
+  column_t posinbars;
+  column_t fibs;
+  column_t fips;
+  column_t iois;
+
+  // running state
+  unsigned int referent;   // MIDI pitch class of the tonic
+  unsigned int bar_length; // quantized duration of a bar
+  unsigned int offset;     // offset of the end of the last event
+
+  // some derived types are undefined for certain pairs of events (e.g. seqint
+  // for leaps outside the interval domain). since not all systems use these
+  // types, we record the first bad value here and only complain if somebody
+  // actually tries to lift the type
+  int bad_interval;
+  unsigned int bad_ioi;
+
+public:
+  // the running state after some prefix of the events: enough to cut the
+  // columns back to that prefix in place, without replaying it
+  struct Checkpoint {
+    size_t size;
+    unsigned int offset;
+    int bad_interval;
+    unsigned int bad_ioi;
+    size_t num_seqints;
+    size_t num_iois;
+  };
+
+  void push_back(const ChoraleEvent &e);
+  void clear();
+
+  Checkpoint checkpoint() const {
+    return { size(), offset, bad_interval, bad_ioi,
+             seqints.size(), iois.size() };
+  }
+
+  // keeps just the events from before the checkpoint, which must have been
+  // taken from these features with no more than size() events
+  void truncate(const Checkpoint &cp);
+
+  const std::vector<ChoraleEvent> &events() const { return event_buf; }
+  size_t size() const { return event_buf.size(); }
+  bool empty() const { return event_buf.empty(); }
+  unsigned int end_offset() const { return offset; } // i.e. total duration
+
+  MidiPitch referent_pitch() const { return MidiPitch(referent); }
+  ChoralePitch last_pitch() const { return ChoralePitch(pitches.back()); }
+
+  template<typename T>
+  CodeView column() const;
+
+  template<typename T>
+  std::vector<T> lifted() const {
+    auto codes = column<T>();
+    return std::vector<T>(codes.begin(), codes.end());
+  }
+
+  ChoraleFeatures();
+  explicit ChoraleFeatures(const std::vector<ChoraleEvent> &es);
+};
+
+template<> inline CodeView
+ChoraleFeatures::column<ChoraleKeySig>() const { return keysigs; }
+
+template<> inline CodeView
+ChoraleFeatures::column<ChoraleTimeSig>() const { return timesigs; }
+
+template<> inline CodeView
+ChoraleFeatures::column<ChoralePitch>() const { return pitches; }
+
+template<> inline CodeView
+ChoraleFeatures::column<ChoraleDuration>() const { return durations; }
+
+template<> inline CodeView
+ChoraleFeatures::column<ChoraleRest>() const { return rests; }
+
+template<> inline CodeView
+ChoraleFeatures::column<ChoraleIntref>() const { return intrefs; }
+
+template<> inline CodeView
+ChoraleFeatures::column<ChoralePosinbar>() const { return posinbars; }
+
+template<> inline CodeView
+ChoraleFeatures::column<ChoraleFib>() const { return fibs; }
+
+template<> inline CodeView
+ChoraleFeatures::column<ChoraleFip>() const { return fips; }
+
+template<> inline CodeView
+ChoraleFeatures::column<ChoraleInterval>() const {
+  if (bad_interval != 0) {
+    std::string msg = "Bad seqint: " + std::to_string(bad_interval);
+    throw ChoraleTypeError(msg);
+  }
+  return seqints;
+}
+
+template<> inline CodeView
+ChoraleFeatures::column<ChoraleIOI>() const {
+  if (bad_ioi != 0) {
+    std::string msg = "Bad IOI: " + std::to_string(bad_ioi);
+    throw ChoraleTypeError(msg);
+  }
+  return iois;
+}
+
 /**********************************************************
  * Chorale Viewpoints
  **********************************************************/
@@ -599,10 +763,45 @@ private:
       return const_cast<ChoraleVPLayer *>(this)->predictors<T>();
   }
 
+  // optional pool used to run the viewpoints of a layer in parallel (not
+  // owned by the layer). only used if there are at least parallel_threshold
+  // viewpoints for the type being predicted.
+  ThreadPool *pool;
+  unsigned int parallel_threshold;
+
 public:
   double entropy_bias; // used for intra-layer combination of VPs
   unsigned int vp_history;
 
+  template<class T>
+  const PredictorList<T> &viewpoints() const { return predictors<T>(); }
+
+  // a cursor for each viewpoint (see Predictor::make_cursor), for predicting
+  // successive contexts along a sequence with this layer
+  struct Cursors {
+    using CursorList = std::vector<std::unique_ptr<PredictorCursor>>;
+    CursorList pitch;
+    CursorList duration;
+    CursorList rest;
+
+    template<class T> CursorList &of();
+  };
+
+  Cursors make_cursors() const;
+
+  // caches successor distributions in the models of the viewpoints added so
+  // far (see Predictor::set_cache_capacity), and the total hits/misses of the
+  // caches
+  void set_cache_capacity(size_t capacity);
+  SuccessorCacheStats cache_stats() const;
+
+  // the viewpoints' models are read-only while predicting, so they can safely
+  // predict concurrently. pass nullptr to go back to predicting sequentially.
+  void set_thread_pool(ThreadPool *tp, unsigned int threshold) {
+    pool = tp;
+    parallel_threshold = threshold;
+  }
+
   std::string debug_summary() const;
 
   template<class T>
@@ -620,13 +819,45 @@ public:
   }
 
   template<class T>
-  EventDistribution<T> predict(const std::vector<ChoraleEvent> &ctx) const;
+  EventDistribution<T> predict(const std::vector<ChoraleEvent> &ctx) const {
+    return predict<T>(ChoraleFeatures(ctx));
+  }
+
+  template<class T>
+  EventDistribution<T> predict(const ChoraleFeatures &ctx,
+                               Cursors *cursors = nullptr) const;
+
+  // empty if none of the viewpoints for T can predict the context
+  template<class T>
+  Prediction<T> try_predict(const ChoraleFeatures &ctx,
+                            Cursors *cursors = nullptr) const;
 
   void reset_viewpoints();
+
+  // a mark for each viewpoint's model, in the order pitch, duration, rest
+  // (see Predictor::checkpoint)
+  using Checkpoint = std::vector<size_t>;
+  Checkpoint checkpoint();
+  void rollback(const Checkpoint &marks);
+  void release_checkpoints();
+
   void learn(const std::vector<ChoraleEvent> &seq);
+  void learn(const ChoraleFeatures &seq);
+  void unlearn(const std::vector<ChoraleEvent> &seq);
+  void unlearn(const ChoraleFeatures &seq);
   void learn_from_tail(const std::vector<ChoraleEvent> &seq);
+  void learn_from_tail(const ChoraleFeatures &seq);
+
+  // copies get their own clones of the viewpoints (e.g. so that a short-term
+  // layer can be trained independently on each thread)
+  ChoraleVPLayer(const ChoraleVPLayer &other);
+
+  // moving keeps the viewpoints themselves where they are, so cursors into
+  // them (see make_cursors) stay valid
+  ChoraleVPLayer(ChoraleVPLayer &&other) = default;
 
   ChoraleVPLayer(double eb, unsigned int vp_hist) : 
+    pool(nullptr), parallel_threshold(0),
     entropy_bias(eb), vp_history(vp_hist) {}
 };
 
@@ -648,39 +879,54 @@ inline std::string ChoraleVPLayer::debug_summary() const {
 
 template<class T>
 EventDistribution<T>
-ChoraleVPLayer::predict(const std::vector<ChoraleEvent> &ctx) const {
-  const auto &vps = predictors<T>();
+ChoraleVPLayer::predict(const ChoraleFeatures &ctx, Cursors *cursors) const {
+  auto result = try_predict<T>(ctx, cursors);
+  if (!result)
+    throw ViewpointPredictionException("No viewpoints can predict context");
 
-  auto it = vps.begin();
-  for (; it != vps.end(); ++it) {
-    if ((*it)->can_predict(ctx))
-      break;
-  }
+  return *result;
+}
 
-  if (it == vps.end())
-    throw ViewpointPredictionException("No viewpoints can predict context");
+template<class T>
+Prediction<T>
+ChoraleVPLayer::try_predict(const ChoraleFeatures &ctx, 
+                            Cursors *cursors) const {
+  const auto &vps = predictors<T>();
+  auto cursor = [cursors](size_t i) -> PredictorCursor * {
+    return cursors ? cursors->of<T>()[i].get() : nullptr;
+  };
 
   if (vps.size() == 1)
-    return (*it)->predict(ctx);
+    return vps.front()->try_predict_at(ctx, cursor(0));
 
-  LogGeoEntropyCombination<T> comb_strategy(entropy_bias);
   std::vector<EventDistribution<T>> predictions;
 
-  for (; it != vps.end(); ++it) {
-    if ((*it)->can_predict(ctx)) {
-      try {
-        auto new_prediction = (*it)->predict(ctx);
-        predictions.push_back(new_prediction);
-      }
-      catch (ViewpointPredictionException e) { }
+  if (pool && vps.size() >= parallel_threshold) {
+    // each viewpoint writes to its own slot, and we combine in the usual order
+    // so that the result doesn't depend on scheduling
+    std::vector<Prediction<T>> slots(vps.size());
+    pool->parallel_for(vps.size(), [&vps, &ctx, &slots, &cursor](size_t i) {
+      slots[i] = vps[i]->try_predict_at(ctx, cursor(i));
+    });
+
+    for (const auto &prediction : slots) {
+      if (prediction)
+        predictions.push_back(*prediction);
+    }
+  }
+  else {
+    for (size_t i = 0; i < vps.size(); i++) {
+      auto prediction = vps[i]->try_predict_at(ctx, cursor(i));
+      if (prediction)
+        predictions.push_back(*prediction);
     }
   }
 
   if (predictions.size() == 0) 
-    throw ViewpointPredictionException("No viewpoints available");
+    return Prediction<T>();
 
-  EventDistribution<T> combined(comb_strategy, predictions);
-  return combined;
+  LogGeoEntropyCombination<T> comb_strategy(entropy_bias);
+  return EventDistribution<T>(comb_strategy, predictions);
 }
 
 
@@ -703,6 +949,18 @@ ChoraleVPLayer::predictors<ChoraleRest>() {
   return rest_predictors;
 }
 
+template<>
+inline ChoraleVPLayer::Cursors::CursorList &
+ChoraleVPLayer::Cursors::of<ChoralePitch>() { return pitch; }
+
+template<>
+inline ChoraleVPLayer::Cursors::CursorList &
+ChoraleVPLayer::Cursors::of<ChoraleDuration>() { return duration; }
+
+template<>
+inline ChoraleVPLayer::Cursors::CursorList &
+ChoraleVPLayer::Cursors::of<ChoraleRest>() { return rest; }
+
 struct MVSConfig {
   static MVSConfig long_term_only(double entropy_bias) {
     MVSConfig config;
@@ -729,6 +987,80 @@ struct MVSConfig {
     mvs_name("default MVS") {}
 };
 
+/* ChoralePredictions
+ *
+ * Distributions over each of the basic types that a ChoraleMVS predicts (see
+ * ChoraleMVS::predict_all). */
+struct ChoralePredictions {
+  EventDistribution<ChoralePitch> pitch;
+  EventDistribution<ChoraleDuration> duration;
+  EventDistribution<ChoraleRest> rest;
+};
+
+struct ChoraleEntropies {
+  double pitch;
+  double duration;
+  double rest;
+};
+
+// a piece generated by a ChoraleMVS, with its average entropies under the MVS
+// (as given by avg_sequence_entropy_all) and the number of candidates that
+// were generated to get it (see ChoraleMVS::sample_pieces). a batch which
+// gives up on a piece marks it as not accepted: it is then the last candidate
+// which the viewpoints could represent, or has no events if there were none.
+struct GeneratedChorale {
+  std::vector<ChoraleEvent> events;
+  ChoraleEntropies entropies;
+  unsigned int attempts;
+  bool accepted;
+};
+
+// how ChoraleMVS::sample_piece draws each event from the predicted
+// distributions: only from the top_k most probable events (0 for no limit),
+// and only from the nucleus of most probable events with total probability
+// top_p (1.0 for no limit). the defaults give plain ancestral sampling.
+struct SamplingConfig {
+  unsigned int top_k;
+  double top_p;
+
+  template<class T>
+  EventDistribution<T> truncate(const EventDistribution<T> &dist) const {
+    return dist.top_k(top_k).top_p(top_p);
+  }
+
+  SamplingConfig() : top_k(0), top_p(1.0) {}
+};
+
+/* GenerationConstraints
+ *
+ * Constraints for ChoraleMVS::sample_constrained. Each step of the piece has a
+ * mask of the pitches, durations and rests allowed there, which is applied to
+ * the predicted distributions before sampling (so these constraints always
+ * hold, rather than being checked afterwards). Optionally, the notes and rests
+ * of the piece must add up to a given total duration, e.g. a whole number of
+ * bars: then only durations and rests from which the total can still be
+ * reached in the remaining steps are allowed. */
+struct GenerationConstraints {
+  struct Step {
+    EventMask<ChoralePitch> pitch;
+    EventMask<ChoraleDuration> duration;
+    EventMask<ChoraleRest> rest;
+
+    Step() { pitch.set(); duration.set(); rest.set(); } // allows anything
+  };
+
+  std::vector<Step> steps; // one per event
+  unsigned int total_duration; // 0 for any
+
+  explicit GenerationConstraints(unsigned int len) : 
+    steps(len), total_duration(0) {}
+
+  // the pitches whose MIDI values satisfy a predicate, e.g. to keep to a range
+  // or end on the tonic
+  static EventMask<ChoralePitch> 
+  pitches_where(const std::function<bool(unsigned int)> &allow);
+};
+
 class ChoraleMVS {
 public:
   // here we declare some viewpoint aliases for convenience, starting with old
@@ -758,12 +1090,57 @@ public:
   using Pred =
     Predictor<ChoraleEvent, T>;
 
+  // incremental prediction over a single piece (see below)
+  class Session;
+
 private:
   ChoraleVPLayer short_term_layer;
   ChoraleVPLayer long_term_layer;
   GenVP<ChoraleKeySig> key_distribution;
   bool enable_short_term;
 
+  // cursors for the viewpoints of both layers, used when predicting along a
+  // sequence (see ChoraleVPLayer::Cursors)
+  struct Cursors {
+    ChoraleVPLayer::Cursors long_term;
+    ChoraleVPLayer::Cursors short_term;
+  };
+
+  // the core of prediction/evaluation, parameterised by the short-term layer to
+  // use. this allows evaluation threads to share the (read-only) long-term
+  // layer while each training their own short-term layer.
+  template<typename T>
+    EventDistribution<T> predict_with(const ChoraleFeatures &ctx,
+                                      const ChoraleVPLayer &st_layer,
+                                      Cursors *cursors = nullptr) const;
+  ChoralePredictions predict_all_with(const ChoraleFeatures &ctx,
+                                      const ChoraleVPLayer &st_layer,
+                                      Cursors *cursors = nullptr) const;
+  ChoraleEntropies sequence_entropies(const std::vector<ChoraleEvent> &seq,
+                                      ChoraleVPLayer &st_layer) const;
+
+  // the core of corpus_entropies: get_piece(i) gives piece i (either by value
+  // or by reference, so a nested corpus isn't copied)
+  template<class GetPiece>
+  std::vector<ChoraleEntropies> corpus_entropies_with(
+    size_t num_pieces, const GetPiece &get_piece, ThreadPool &pool) const;
+
+  // the core of sample_piece: generates len events in the session, where
+  // draw(i, predictions) picks the event at step i
+  using EventDrawer = 
+    std::function<ChoraleEvent(unsigned int, const ChoralePredictions &)>;
+  GeneratedChorale sample_with(Session &session, unsigned int len,
+                               const EventDrawer &draw) const;
+
+  // the core of sample_pieces: generate(session, rs) makes a candidate
+  using PieceGenerator = 
+    std::function<GeneratedChorale(Session &, RandomSource *)>;
+  std::vector<GeneratedChorale> sample_batch(
+    size_t num_pieces, const PieceGenerator &generate,
+    const std::function<bool(const ChoraleEntropies &)> &accept,
+    unsigned int max_attempts, xoroshiro128plus_engine engine,
+    ThreadPool &pool) const;
+
 public:
   double entropy_bias;
   const std::string mvs_name;
@@ -776,17 +1153,75 @@ public:
       << long_term_layer.debug_summary() << std::endl;
   }
 
+  // predict with the long-term viewpoints in parallel when there are at least
+  // `threshold` of them for a type (see ChoraleVPLayer::set_thread_pool)
+  void set_thread_pool(ThreadPool *pool, unsigned int threshold) {
+    long_term_layer.set_thread_pool(pool, threshold);
+  }
+
+  bool short_term_enabled() const { return enable_short_term; }
+
+  // the long-term models don't change once trained, so they can cache the
+  // distributions they predict for contexts that come up again and again
+  // (e.g. openings and cadences). the cache is emptied by any more training.
+  void set_long_term_cache(size_t capacity) {
+    long_term_layer.set_cache_capacity(capacity);
+  }
+  SuccessorCacheStats long_term_cache_stats() const {
+    return long_term_layer.cache_stats();
+  }
+
+  // caches the predictions over T of each of this system's viewpoints (both
+  // long- and short-term) on the corpus of the given cache. in the cache, the
+  // system is then made up of all the viewpoints added (see
+  // PredictionCache::all_viewpoints).
+  template<typename T>
+  void cache_predictions(PredictionCache<ChoraleEvent, T> &cache,
+                         ThreadPool &pool) const {
+    std::vector<const Pred<T> *> lt_vps, st_vps;
+    for (const auto &vp_ptr : long_term_layer.viewpoints<T>())
+      lt_vps.push_back(vp_ptr.get());
+    for (const auto &vp_ptr : short_term_layer.viewpoints<T>())
+      st_vps.push_back(vp_ptr.get());
+    cache.add_trained(lt_vps, st_vps, pool);
+  }
+
   void set_intra_layer_bias(double value) {
     short_term_layer.entropy_bias = value;
     long_term_layer.entropy_bias = value;
   }
 
   template<typename T>
-    EventDistribution<T> predict(const std::vector<ChoraleEvent> &ctx) const;
+    EventDistribution<T> predict(const std::vector<ChoraleEvent> &ctx) const {
+      return predict<T>(ChoraleFeatures(ctx));
+    }
+
+  template<typename T>
+    EventDistribution<T> predict(const ChoraleFeatures &ctx) const;
 
   template<typename T>
     double avg_sequence_entropy(const std::vector<ChoraleEvent> &seq);
 
+  // predictions for all of the basic types at once, sharing the context
+  // features (and, for avg_sequence_entropy_all, the short-term training)
+  ChoralePredictions predict_all(const ChoraleFeatures &ctx) const;
+  ChoraleEntropies avg_sequence_entropy_all(const std::vector<ChoraleEvent> &seq);
+
+  // avg_sequence_entropy_all for each piece in a corpus, evaluated across the
+  // threads of the given pool. each worker uses its own copy of the short-term
+  // layer, and the results don't depend on how pieces are scheduled.
+  std::vector<ChoraleEntropies> corpus_entropies(
+    const std::vector<std::vector<ChoraleEvent>> &corpus, 
+    ThreadPool &pool) const;
+
+  // the same for a corpus of num_pieces pieces stored some other way (e.g. a
+  // FlatCorpus): get_piece(i) must give piece i, and is called from the
+  // evaluation threads.
+  std::vector<ChoraleEntropies> corpus_entropies(
+    size_t num_pieces,
+    const std::function<std::vector<ChoraleEvent>(size_t)> &get_piece,
+    ThreadPool &pool) const;
+
   template<typename T>
     std::vector<double>
     cross_entropies(const std::vector<ChoraleEvent> &seq) const;
@@ -798,8 +1233,73 @@ public:
   std::vector<ChoraleEvent> 
   random_walk(unsigned int len, const QuantizedDuration &timesig);
 
+  // generates a piece like random_walk, but in the given session (so the MVS
+  // itself isn't modified) and drawing from the given source. the entropies
+  // of the piece are worked out from the distributions it was sampled from
+  // (before any truncation by the sampling config). an event which the
+  // viewpoints can't represent is rolled back (see Session::checkpoint) and
+  // drawn again; ChoraleTypeError is thrown if that keeps happening.
+  GeneratedChorale sample_piece(Session &session, unsigned int len,
+                                const QuantizedDuration &timesig,
+                                RandomSource *rs,
+                                const SamplingConfig &sampling = 
+                                  SamplingConfig()) const;
+
+  // generates num_pieces pieces across the threads of the pool. candidates for
+  // each piece are generated until one is accepted (accept is called from the
+  // worker threads), and candidates which the viewpoints can't represent are
+  // rejected too. after max_attempts candidates, the piece is given up on and
+  // marked as not accepted (see GeneratedChorale). each worker has its own
+  // session, and piece i is drawn from its own stream (the engine jumped i
+  // times), so the results don't depend on the number of threads or on
+  // scheduling.
+  std::vector<GeneratedChorale> sample_pieces(
+    size_t num_pieces, unsigned int len, const QuantizedDuration &timesig,
+    const std::function<bool(const ChoraleEntropies &)> &accept,
+    unsigned int max_attempts, xoroshiro128plus_engine engine, ThreadPool &pool,
+    const SamplingConfig &sampling = SamplingConfig()) const;
+
+  // generates a piece in the given key which satisfies the constraints, as
+  // sample_piece does otherwise (e.g. it redraws events which the viewpoints
+  // can't represent, but it doesn't start on the tonic unless the constraints
+  // say so). the length of the piece is the number of steps constrained.
+  // throws ConstraintError if the constraints can't be satisfied.
+  GeneratedChorale sample_constrained(Session &session,
+                                      const ChoraleKeySig &keysig,
+                                      const QuantizedDuration &timesig,
+                                      const GenerationConstraints &constraints,
+                                      RandomSource *rs,
+                                      const SamplingConfig &sampling = 
+                                        SamplingConfig()) const;
+
+  // sample_pieces for constrained pieces
+  std::vector<GeneratedChorale> sample_constrained_pieces(
+    size_t num_pieces, const ChoraleKeySig &keysig,
+    const QuantizedDuration &timesig, const GenerationConstraints &constraints,
+    const std::function<bool(const ChoraleEntropies &)> &accept,
+    unsigned int max_attempts, xoroshiro128plus_engine engine, ThreadPool &pool,
+    const SamplingConfig &sampling = SamplingConfig()) const;
+
+  // finds likely pieces in the given key by beam search: at each step, every
+  // partial piece is extended by its most likely next events, and only the
+  // beam_width most likely extensions overall (by their total information
+  // content) which the viewpoints can represent are kept. each partial piece
+  // has its own session, so its short-term models have learned exactly that
+  // piece: extensions are tried out in their parent's session and rolled
+  // back, and a session is only copied when several extensions of the same
+  // piece are kept. returns the final beam, most likely piece first; as in
+  // random_walk, pieces start on the tonic.
+  std::vector<GeneratedChorale> beam_search(unsigned int len,
+                                            const QuantizedDuration &timesig,
+                                            const ChoraleKeySig &keysig,
+                                            unsigned int beam_width) const;
+
   void learn(const std::vector<ChoraleEvent> &seq);
 
+  // takes a previously learned piece back out of the long-term model, leaving
+  // it exactly as if the piece had never been learned
+  void unlearn(const std::vector<ChoraleEvent> &seq);
+
   template<class T>
   void add_viewpoint(Pred<T> *p) {
     long_term_layer.add_viewpoint(p);
@@ -821,27 +1321,189 @@ inline ChoraleMVS::learn(const std::vector<ChoraleEvent> &seq) {
   long_term_layer.learn(seq);
 }
 
+void
+inline ChoraleMVS::unlearn(const std::vector<ChoraleEvent> &seq) {
+  key_distribution.unlearn({seq[0]});
+  long_term_layer.unlearn(seq);
+}
+
+/* ChoraleMVS::Session
+ *
+ * Feeds a piece to an MVS one event at a time, giving the predicted
+ * distribution over the next event at each step. The session keeps the
+ * context's lifted features (ChoraleFeatures extends them incrementally), its
+ * own short-term layer, which learns each event as it is pushed, and where the
+ * context is matched in each viewpoint's model (see ChoraleVPLayer::Cursors).
+ * So each step costs the same however long the piece gets, and callers don't
+ * need to pass the whole context every time.
+ *
+ * The MVS isn't modified, so any number of sessions can run against the same
+ * trained MVS at once (e.g. on different threads). Predictions agree exactly
+ * with evaluating the piece with the MVS itself. */
+class ChoraleMVS::Session {
+  const ChoraleMVS &mvs;
+  ChoraleFeatures context;
+  ChoraleVPLayer st_layer;
+  mutable Cursors cursors; // moved along by each prediction
+
+public:
+  explicit Session(const ChoraleMVS &m) : 
+    mvs(m), st_layer(m.short_term_layer) {
+    st_layer.reset_viewpoints();
+    cursors.long_term = mvs.long_term_layer.make_cursors();
+    cursors.short_term = st_layer.make_cursors();
+  }
+
+  // a copy carries on from the same point independently of the original
+  // (e.g. to branch a search). it starts with fresh cursors, which match the
+  // context again the first time they are used.
+  Session(const Session &other) :
+    mvs(other.mvs), context(other.context), st_layer(other.st_layer) {
+    cursors.long_term = mvs.long_term_layer.make_cursors();
+    cursors.short_term = st_layer.make_cursors();
+  }
+
+  Session(Session &&other) = default;
+
+  void push(const ChoraleEvent &e) {
+    context.push_back(e);
+    if (mvs.enable_short_term)
+      st_layer.learn_from_tail(context);
+  }
+
+  // the predicted distribution over the next event
+  template<typename T>
+  EventDistribution<T> next() const {
+    return mvs.predict_with<T>(context, st_layer, &cursors);
+  }
+
+  ChoralePredictions next_all() const {
+    return mvs.predict_all_with(context, st_layer, &cursors);
+  }
+
+  // starts again with an empty context (e.g. for the next piece). this
+  // drops any checkpoints.
+  void reset() {
+    context.clear();
+    st_layer.reset_viewpoints();
+  }
+
+  // a point to come back to, e.g. to take back an event and try another
+  struct Checkpoint {
+    ChoraleFeatures::Checkpoint context;
+    ChoraleVPLayer::Checkpoint st_layer;
+  };
+
+  // marks the session as it is now (see Predictor::checkpoint)
+  Checkpoint checkpoint() {
+    return { context.checkpoint(), st_layer.checkpoint() };
+  }
+
+  // takes back every event pushed since the checkpoint, along with what the
+  // short-term layer learned from them
+  void rollback(const Checkpoint &cp) {
+    context.truncate(cp.context);
+    st_layer.rollback(cp.st_layer);
+  }
+
+  // drops all the checkpoints, keeping the events pushed since them
+  void release_checkpoints() { st_layer.release_checkpoints(); }
+
+  size_t size() const { return context.size(); }
+  const ChoraleFeatures &features() const { return context; }
+};
+
+template<typename T>
+EventDistribution<T>
+ChoraleMVS::predict(const ChoraleFeatures &ctx) const {
+  return predict_with<T>(ctx, short_term_layer);
+}
+
 template<typename T>
 EventDistribution<T>
-ChoraleMVS::predict(const std::vector<ChoraleEvent> &ctx) const {
-  auto lt_prediction = long_term_layer.predict<T>(ctx);
+ChoraleMVS::predict_with(const ChoraleFeatures &ctx,
+                         const ChoraleVPLayer &st_layer,
+                         Cursors *cursors) const {
+  auto lt_prediction = 
+    long_term_layer.predict<T>(ctx, cursors ? &cursors->long_term : nullptr);
   if (enable_short_term) {
     LogGeoEntropyCombination<T> comb_strategy(entropy_bias);
-    auto st_prediction = short_term_layer.predict<T>(ctx);
+    auto st_prediction = 
+      st_layer.predict<T>(ctx, cursors ? &cursors->short_term : nullptr);
     return EventDistribution<T>(comb_strategy, {st_prediction, lt_prediction});
   }
   return lt_prediction;
 }
 
+inline ChoralePredictions
+ChoraleMVS::predict_all(const ChoraleFeatures &ctx) const {
+  return predict_all_with(ctx, short_term_layer);
+}
+
+inline ChoralePredictions
+ChoraleMVS::predict_all_with(const ChoraleFeatures &ctx,
+                             const ChoraleVPLayer &st_layer,
+                             Cursors *cursors) const {
+  return { 
+    predict_with<ChoralePitch>(ctx, st_layer, cursors), 
+    predict_with<ChoraleDuration>(ctx, st_layer, cursors), 
+    predict_with<ChoraleRest>(ctx, st_layer, cursors) 
+  };
+}
+
+/* Equivalent to calling avg_sequence_entropy for each basic type, but the
+ * short-term layer only has to be trained on the sequence once */
+inline ChoraleEntropies
+ChoraleMVS::avg_sequence_entropy_all(const std::vector<ChoraleEvent> &seq) {
+  return sequence_entropies(seq, short_term_layer);
+}
+
+inline ChoraleEntropies
+ChoraleMVS::sequence_entropies(const std::vector<ChoraleEvent> &seq,
+                               ChoraleVPLayer &st_layer) const {
+  if (enable_short_term)
+    st_layer.reset_viewpoints();
+  ChoraleFeatures ngram_buf;
+  Cursors cursors{ long_term_layer.make_cursors(), st_layer.make_cursors() };
+
+  ChoraleEntropies total{0.0, 0.0, 0.0};
+  auto dists = predict_all_with(ngram_buf, st_layer, &cursors);
+
+  for (const auto &e : seq) {
+    total.pitch -= std::log2(dists.pitch.probability_for(e.project<ChoralePitch>()));
+    total.duration -= std::log2(dists.duration.probability_for(
+                                        e.project<ChoraleDuration>()));
+    total.rest -= std::log2(dists.rest.probability_for(e.project<ChoraleRest>()));
+    ngram_buf.push_back(e);
+    if (enable_short_term)
+      st_layer.learn_from_tail(ngram_buf);
+    dists = predict_all_with(ngram_buf, st_layer, &cursors);
+  }
+
+  ChoraleEntropies avg{
+    total.pitch / seq.size(),
+    total.duration / seq.size(),
+    total.rest / seq.size()
+  };
+
+  for (double h : { avg.pitch, avg.duration, avg.rest }) {
+    if (h > 100.0) 
+      std::cerr << "Warning: very high average entropy (" 
+        << h << ")" << std::endl;
+  }
+
+  return avg;
+}
+
 template<typename T>
 double 
 ChoraleMVS::avg_sequence_entropy(const std::vector<ChoraleEvent> &seq) {
   if (enable_short_term)
     short_term_layer.reset_viewpoints();
-  std::vector<ChoraleEvent> ngram_buf;
+  ChoraleFeatures ngram_buf;
 
   double total_entropy = 0.0;
-  auto dist = predict<T>({});
+  auto dist = predict<T>(ngram_buf);
 
   for (const auto &e : seq) {
     const auto v = e.project<T>();
@@ -863,10 +1525,10 @@ ChoraleMVS::avg_sequence_entropy(const std::vector<ChoraleEvent> &seq) {
 template<typename T>
 std::vector<double>
 ChoraleMVS::cross_entropies(const std::vector<ChoraleEvent> &seq) const {
-  std::vector<ChoraleEvent> ngram_buf;
+  ChoraleFeatures ngram_buf;
   std::vector<double> entropies;
 
-  auto dist = predict<T>({});
+  auto dist = predict<T>(ngram_buf);
 
   for (const auto &e : seq) {
     const auto v = e.project<T>();
@@ -881,10 +1543,10 @@ ChoraleMVS::cross_entropies(const std::vector<ChoraleEvent> &seq) const {
 template<typename T>
 std::vector<double>
 ChoraleMVS::dist_entropies(const std::vector<ChoraleEvent> &seq) const {
-  std::vector<ChoraleEvent> ngram_buf;
+  ChoraleFeatures ngram_buf;
   std::vector<double> entropies;
 
-  auto dist = predict<T>({});
+  auto dist = predict<T>(ngram_buf);
 
   for (const auto &e : seq) {
     entropies.push_back(dist.entropy());
@@ -13,6 +13,17 @@
 
 typedef std::pair<unsigned, std::list<unsigned int>> Ngram;
 
+/* SparseSuccessors
+ *
+ * The distribution over the next event predicted by PPM, in sparse form. Events
+ * which have been seen in some context along the chain of escapes are listed
+ * explicitly. Every other event shares the escape mass which reaches the
+ * uniform (order -1) model, so each has the same probability `unseen`. */
+struct SparseSuccessors {
+  std::vector<std::pair<unsigned int, double>> seen;
+  double unseen;
+};
+
 struct GraphWriter {
   std::string node_decls;
   std::string edge_list;
@@ -27,9 +38,15 @@ template<int b>
 struct TrieNode {
   TrieNode *children[b];
   std::bitset<b> child_mask; // 1 where we have a child, 0 elsewhere
+  std::vector<unsigned int> child_codes; // the same children, in order
   TrieNode *parent;
   unsigned int count;
 
+  // children are only ever added and removed through these, which keep the
+  // mask and the list of codes in step
+  TrieNode *add_child(unsigned int event);
+  void remove_child(unsigned int event);
+
   TrieNode();
   ~TrieNode();
   TrieNode(const TrieNode &other);
@@ -45,8 +62,34 @@ template<int b>
 class ContextModel {
   TrieNode<b> trie_root;
   unsigned int history;
+
+  // bumped whenever nodes are added to/removed from the trie, so that cursors
+  // can tell when it has changed under them
+  unsigned long nodes_added;
+  unsigned long nodes_removed;
+
+  // the nodes whose counts have been incremented since the first checkpoint,
+  // in order (see checkpoint). a copy of a model starts without checkpoints,
+  // since the nodes in the log belong to the original.
+  struct UndoLog {
+    std::vector<TrieNode<b> *> incremented;
+    bool recording;
+
+    UndoLog() : recording(false) {}
+    UndoLog(const UndoLog &) : recording(false) {}
+    UndoLog &operator=(const UndoLog &) {
+      incremented.clear();
+      recording = false;
+      return *this;
+    }
+  };
+
+  UndoLog undo_log;
+
   void addOrIncrement(const std::vector<unsigned int> &seq, 
                       const size_t i_begin, const size_t i_end);
+  void decrement(const std::vector<unsigned int> &seq,
+                 const size_t i_begin, const size_t i_end);
   const TrieNode<b> *match_context(const std::vector<unsigned int> &seq, 
                                    const unsigned int i_start,
                                    const unsigned int i_end,
@@ -62,29 +105,105 @@ class ContextModel {
                const std::bitset<b> &dead) const;
 
 public:
+  class Cursor;
+
   void set_history(unsigned int h);
   unsigned int get_history() const { return history; }
+  const TrieNode<b> &get_root() const { return trie_root; }
   void learn_sequence(const std::vector<unsigned int> &seq);
+  void unlearn_sequence(const std::vector<unsigned int> &seq);
   void update_from_tail(const std::vector<unsigned int> &seq);
   void get_ngrams(const unsigned int n, std::list<Ngram> &result);
   unsigned int count_of(const std::vector<unsigned int> &seq) const;
   unsigned int count_of(const std::vector<unsigned int> &seq);
   double probability_of(const std::vector<unsigned int> &seq) const;
+  void successors(const std::vector<unsigned int> &ctx, 
+                  SparseSuccessors &result) const;
+  void successors(const Cursor &cursor, SparseSuccessors &result) const;
   double avg_sequence_entropy(const std::vector<unsigned int> &seq) const;
   void write_latex(const std::string &fname, 
       std::string (*decoder)(unsigned int)) const;
   void debug_summary();
   void clear_model(); // unlearn everything so far
 
+  // checkpoints let a model which is being trained incrementally (e.g. a
+  // short-term model) go back to an earlier state without being cleared and
+  // retrained. checkpoint() returns a mark, after which the model logs every
+  // count that learning increments. rollback(mark) takes those increments
+  // back, removing any nodes they added, which leaves the model exactly as it
+  // was when the mark was taken. marks nest: rolling back to a mark also
+  // discards any taken after it.
+  //
+  // nothing may be unlearned while checkpoints are held. clear_model and
+  // release_checkpoints drop all the checkpoints (and stop logging), keeping
+  // whatever has been learned.
+  size_t checkpoint();
+  void rollback(size_t mark);
+  void release_checkpoints();
+
   ContextModel(unsigned int history);
 };
 
+/* ContextModel<b>::Cursor
+ *
+ * Tracks where a growing context is matched in the trie, so that successive
+ * predictions along a sequence don't each have to match their context from
+ * scratch (which takes O(h^2) steps).
+ *
+ * The cursor holds the node for each suffix of the context that is in the
+ * trie, up to the (h-1) events that prediction looks at: these are exactly the
+ * contexts visited by the chain of escapes in PPM. Every n-gram is learned
+ * along with all of its suffixes, so the suffixes in the trie are always the
+ * shortest few. When an event is appended, the suffix of length k+1 is then
+ * just a child of the old suffix of length k, so the cursor moves in O(h).
+ *
+ * The model may change while a cursor is in use (e.g. a short-term model
+ * learning each event after predicting it). Nodes added to the trie are picked
+ * up the next time the cursor moves, and if any have been removed the cursor
+ * matches its context again from scratch. */
+template<int b>
+class ContextModel<b>::Cursor {
+  friend class ContextModel<b>;
+
+  const ContextModel *model;
+  std::vector<unsigned int> symbols; // the last (at most h-1) events
+  std::vector<const TrieNode<b> *> suffixes; // [k] matches the last k symbols
+  unsigned long nodes_added;
+  unsigned long nodes_removed;
+
+  size_t max_length() const {
+    return (model->history > 0) ? model->history - 1 : 0;
+  }
+
+  void extend();
+
+public:
+  explicit Cursor(const ContextModel &m) : model(&m), 
+    suffixes(1, &m.trie_root), 
+    nodes_added(m.nodes_added), nodes_removed(m.nodes_removed) {}
+
+  void reset(); // back to the empty context
+  void append(unsigned int symbol);
+
+  // moves the cursor to the end of a context. if this just extends the
+  // context that the cursor was at by one event, this is the same as append,
+  // otherwise the context is matched from scratch.
+  void follow(const std::vector<unsigned int> &ctx);
+
+  // the events that the cursor has matched (at most h-1 of them)
+  const std::vector<unsigned int> &context() const { return symbols; }
+
+  // the order of the longest context matched
+  size_t matched_length() const { return suffixes.size() - 1; }
+};
+
 /**************************************************
  * ContextModel: public methods
  **************************************************/
 
 template<int b>
-ContextModel<b>::ContextModel(unsigned int h) : history(h) {}
+ContextModel<b>::ContextModel(unsigned int h) : 
+  history(h), nodes_added(0), nodes_removed(0) {}
 
 template<int b>
 void ContextModel<b>::debug_summary() {
@@ -104,15 +223,54 @@ void ContextModel<b>::set_history(unsigned int h) {
 
 template<int b>
 void ContextModel<b>::clear_model() {
-  for (unsigned int i = 0; i < b; i++) {
-    if (trie_root.children[i] != nullptr) {
-      delete trie_root.children[i];
-      trie_root.children[i] = nullptr;
-    }
+  while (!trie_root.child_codes.empty()) {
+    trie_root.remove_child(trie_root.child_codes.back());
+    nodes_removed++;
   }
 
   trie_root.count = 0;
-  trie_root.child_mask.reset();
+  release_checkpoints();
+}
+
+template<int b>
+size_t ContextModel<b>::checkpoint() {
+  undo_log.recording = true;
+  return undo_log.incremented.size();
+}
+
+template<int b>
+void ContextModel<b>::rollback(size_t mark) {
+  auto &log = undo_log.incremented;
+  assert(undo_log.recording && mark <= log.size());
+
+  while (log.size() > mark) {
+    TrieNode<b> *node = log.back();
+    log.pop_back();
+    assert(node->count > 0);
+    node->count--;
+
+    // as in decrement, except that we have to look for the node's event
+    while (node != &trie_root && node->count == 0 && node->child_mask.none()) {
+      TrieNode<b> *parent = node->parent;
+      unsigned int event = 0;
+      for (auto code : parent->child_codes) {
+        if (parent->children[code] == node) {
+          event = code;
+          break;
+        }
+      }
+
+      parent->remove_child(event);
+      nodes_removed++;
+      node = parent;
+    }
+  }
+}
+
+template<int b>
+void ContextModel<b>::release_checkpoints() {
+  undo_log.incremented.clear();
+  undo_log.recording = false;
 }
 
 template<int b>
@@ -140,6 +298,87 @@ ContextModel<b>::probability_of(const std::vector<unsigned int> &seq) const {
   return ppm_a(seq, i_begin, seq.size() - 1, std::bitset<b>());
 }
 
+/* Calculates the PPM A distribution over all possible successors of a context
+ * in a single pass. 
+ *
+ * This is equivalent to calling probability_of for each candidate event, but
+ * we only match each context on the chain of escapes once, and only visit the
+ * children that are actually present at each level. All of the unseen events
+ * get the same (analytically computed) escape mass. Values are computed with
+ * exactly the same sequence of floating point operations as ppm_a. */
+template<int b> void
+ContextModel<b>::successors(const std::vector<unsigned int> &ctx,
+                            SparseSuccessors &result) const {
+  Cursor cursor(*this);
+  cursor.follow(ctx);
+  successors(cursor, result);
+}
+
+// as above, for the context that the cursor is at
+template<int b> void
+ContextModel<b>::successors(const Cursor &cursor,
+                            SparseSuccessors &result) const {
+  assert(cursor.model == this);
+  assert(cursor.nodes_added == nodes_added && 
+         cursor.nodes_removed == nodes_removed);
+
+  result.seen.clear();
+  result.unseen = 0.0;
+
+  // events seen at a longer context, which PPM A excludes at shorter ones
+  std::bitset<b> dead;
+  unsigned int num_dead = 0;
+  std::vector<double> escape_denoms;
+
+  // divide through by the denominators of the levels above in the same order
+  // as the recursion in ppm_a would
+  auto escape = [&escape_denoms](double value) {
+    for (auto it = escape_denoms.rbegin(); it != escape_denoms.rend(); ++it)
+      value /= *it;
+    return value;
+  };
+
+  // escape from the longest matched context down to the empty one
+  size_t level = (history > 0) ? 
+    std::min(cursor.suffixes.size(), (size_t)history) : 0;
+  while (level > 0) {
+    const TrieNode<b> *ctx_node = cursor.suffixes[--level];
+
+    // one pass over the children present (not over all b events), which
+    // gathers the counts of those not yet seen and marks them dead. the
+    // counts are turned into probabilities once the total is known.
+    const size_t first = result.seen.size();
+    int sum = 0;
+    for (auto code : ctx_node->child_codes) {
+      if (dead[code])
+        continue;
+
+      auto count = ctx_node->children[code]->count;
+      sum += count;
+      result.seen.push_back({code, (double)count});
+      dead.set(code);
+    }
+
+    num_dead += result.seen.size() - first;
+    bool any_novel = num_dead < b;
+
+    double known_total = (double)sum;
+    double denom = any_novel ? (1.0 + known_total) : known_total;
+    for (size_t i = first; i < result.seen.size(); i++)
+      result.seen[i].second = escape(result.seen[i].second / denom);
+
+    // no novel events, so nothing escapes to lower orders
+    if (!any_novel)
+      return;
+
+    escape_denoms.push_back(denom);
+  }
+
+  // base case: the remaining events share the uniform distribution
+  assert(num_dead < b);
+  result.unseen = escape(1.0 / (double)(b - num_dead));
+}
+
 template<int b>
 double ContextModel<b>::
 avg_sequence_entropy(const std::vector<unsigned int> &seq) const {
@@ -178,7 +417,7 @@ ContextModel<b>::match_context(const std::vector<unsigned int> &seq,
                                const unsigned int i_start,
                                const unsigned int i_end,
                                      unsigned int &i_matched) const {
-  assert(i_end <= seq.size() - 1);
+  assert(i_end <= seq.size());
 
   const TrieNode<b> *node = &trie_root;
 
@@ -238,9 +477,9 @@ ContextModel<b>::ppm_a(const std::vector<unsigned int> &seq,
   std::bitset<b> novel_events = ~seen_or_dead;
   std::bitset<b> known_events = ctx_node->child_mask & ~dead;
 
-  for (unsigned int i = 0; i < b; i++) {
-    if (known_events[i])
-      sum += ctx_node->children[i]->count;
+  for (auto code : ctx_node->child_codes) {
+    if (known_events[code])
+      sum += ctx_node->children[code]->count;
   }
 
   double known_total = (double)sum;
@@ -266,15 +505,43 @@ void ContextModel<b>::addOrIncrement(const std::vector<unsigned int> &seq,
   for (size_t i = i_begin; i < i_end; i++) {
     unsigned int event = seq[i];
     if (node->children[event] == nullptr) {
-      node->children[event] = new TrieNode<b>();
-      node->children[event]->parent = node;
-      node->child_mask.set(event);
+      node->add_child(event);
+      nodes_added++;
     }
 
     node = node->children[event];
   }
   
   node->count++;
+  if (undo_log.recording)
+    undo_log.incremented.push_back(node);
+}
+
+// the inverse of addOrIncrement. nodes which are left with a zero count and no
+// children are removed, so that the trie ends up exactly as if the n-gram had
+// never been added.
+template<int b>
+void ContextModel<b>::decrement(const std::vector<unsigned int> &seq,
+                                const size_t i_begin,
+                                const size_t i_end) {
+  assert(!undo_log.recording);
+  TrieNode<b> *node = &trie_root;
+
+  for (size_t i = i_begin; i < i_end; i++) {
+    node = node->children[seq[i]];
+    assert(node != nullptr);
+  }
+
+  assert(node->count > 0);
+  node->count--;
+
+  size_t i = i_end;
+  while (node != &trie_root && node->count == 0 && node->child_mask.none()) {
+    TrieNode<b> *parent = node->parent;
+    parent->remove_child(seq[--i]);
+    nodes_removed++;
+    node = parent;
+  }
 }
 
 template<int b>
@@ -297,6 +564,20 @@ void ContextModel<b>::learn_sequence(const std::vector<unsigned int> &seq) {
       addOrIncrement(seq, beg, end);
 }
 
+// removes exactly the n-grams that learn_sequence adds for the same sequence
+// (which must have been learned before). this lets us take a sequence back out
+// of a model trained on a whole corpus, e.g. for cross-validation.
+template<int b>
+void ContextModel<b>::unlearn_sequence(const std::vector<unsigned int> &seq) {
+  for (size_t cap = 1; cap < history; cap++) 
+    for (size_t beg = 0; beg <= cap; beg++)
+      decrement(seq, beg, cap);
+    
+  for (size_t end = history; end <= seq.size(); end++) 
+    for (size_t beg = end - history; beg <= end; beg++) 
+      decrement(seq, beg, end);
+}
+
 // takes h-, (h-1)-, ..., 1-grams from the end of a sequence
 // and updates the context model with them.
 //
@@ -314,6 +595,94 @@ ContextModel<b>::get_ngrams(const unsigned int n, std::list<Ngram> &result) {
   trie_root.get_ngrams(n, result);
 }
 
+/**************************************************
+ * ContextModel::Cursor
+ **************************************************/
+
+template<int b>
+void ContextModel<b>::Cursor::reset() {
+  symbols.clear();
+  suffixes.assign(1, &model->trie_root);
+  nodes_added = model->nodes_added;
+  nodes_removed = model->nodes_removed;
+}
+
+template<int b>
+void ContextModel<b>::Cursor::append(unsigned int symbol) {
+  const size_t max_len = max_length();
+  symbols.push_back(symbol);
+  if (symbols.size() > max_len)
+    symbols.erase(symbols.begin(), symbols.end() - max_len);
+
+  // (if nodes have been removed, extend starts again from scratch)
+  if (nodes_removed == model->nodes_removed) {
+    // the new suffix of length k is a child of the old one of length (k-1).
+    // working downwards means we only overwrite entries once we're done
+    // with them.
+    size_t len = std::min(suffixes.size(), max_len);
+    suffixes.resize(len + 1);
+    for (size_t k = len; k > 0; k--)
+      suffixes[k] = suffixes[k-1]->children[symbol];
+
+    size_t matched = 1;
+    while (matched <= len && suffixes[matched] != nullptr)
+      matched++;
+    suffixes.resize(matched);
+  }
+
+  extend();
+}
+
+template<int b>
+void ContextModel<b>::Cursor::follow(const std::vector<unsigned int> &ctx) {
+  const size_t len = std::min(ctx.size(), max_length());
+  auto window = ctx.end() - len;
+
+  if (len == symbols.size() && 
+      std::equal(symbols.begin(), symbols.end(), window)) {
+    extend();
+    return;
+  }
+
+  // is ctx what we'd get by appending its last event?
+  if (len > 0 && len == std::min(symbols.size() + 1, max_length()) &&
+      std::equal(symbols.end() - (len - 1), symbols.end(), window)) {
+    append(ctx.back());
+    return;
+  }
+
+  reset();
+  for (; window != ctx.end(); ++window)
+    append(*window);
+}
+
+// if the trie has changed since the cursor last moved, longer suffixes of the
+// context might now be in it
+template<int b>
+void ContextModel<b>::Cursor::extend() {
+  if (nodes_added == model->nodes_added && 
+      nodes_removed == model->nodes_removed)
+    return;
+
+  // nodes that we point to may have been deleted
+  if (nodes_removed != model->nodes_removed)
+    suffixes.assign(1, &model->trie_root);
+
+  while (suffixes.size() <= symbols.size()) {
+    const TrieNode<b> *node = &model->trie_root;
+    for (auto it = symbols.end() - suffixes.size(); 
+         node != nullptr && it != symbols.end(); ++it)
+      node = node->children[*it];
+
+    if (node == nullptr)
+      break;
+    suffixes.push_back(node);
+  }
+
+  nodes_added = model->nodes_added;
+  nodes_removed = model->nodes_removed;
+}
+
 // TrieNode implementation
 
 template<int b>
@@ -336,9 +705,8 @@ TrieNode<b>::TrieNode() :
 
 template<int b>
 TrieNode<b>::~TrieNode() {
-  for (unsigned int i = 0; i < b; i++) 
-    if (children[i] != nullptr)
-      delete children[i];
+  for (auto code : child_codes)
+    delete children[code];
 }
 
 template<int b>
@@ -346,16 +714,36 @@ TrieNode<b>::TrieNode(const TrieNode &other) {
   parent = nullptr;
   count = other.count;
   child_mask = other.child_mask;
-  for (unsigned int i = 0; i < b; i++)  {
-    if (other.children[i] != nullptr) {
-      children[i] = new TrieNode<b>(*other.children[i]);
-      children[i]->parent = this;
-    }
-    else
-      children[i] = nullptr;
+  child_codes = other.child_codes;
+  for (unsigned int i = 0; i < b; i++)
+    children[i] = nullptr;
+  for (auto code : child_codes) {
+    children[code] = new TrieNode<b>(*other.children[code]);
+    children[code]->parent = this;
   }
 }
 
+template<int b>
+TrieNode<b> *TrieNode<b>::add_child(unsigned int event) {
+  assert(children[event] == nullptr);
+  children[event] = new TrieNode<b>();
+  children[event]->parent = this;
+  child_mask.set(event);
+  child_codes.insert(
+    std::lower_bound(child_codes.begin(), child_codes.end(), event), event);
+  return children[event];
+}
+
+template<int b>
+void TrieNode<b>::remove_child(unsigned int event) {
+  assert(children[event] != nullptr);
+  delete children[event];
+  children[event] = nullptr;
+  child_mask.reset(event);
+  child_codes.erase(
+    std::lower_bound(child_codes.begin(), child_codes.end(), event));
+}
+
 template<int b>
 void TrieNode<b>::get_ngrams(const unsigned int n, std::list<Ngram> &result) {
   assert(n > 0);
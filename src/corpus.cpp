@@ -0,0 +1,737 @@
+#include "corpus.hpp"
+
+#include <array>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char binary_magic[4] = { 'P', '2', 'C', 'B' };
+const uint32_t binary_version = 1;
+
+/***************************************************
+ * Domain checking
+ ***************************************************/
+
+template<class T>
+void validate_domain(const std::vector<int> &domain) {
+  if (domain.size() > T::cardinality) {
+    throw CorpusError("Corpus " + T::type_name + " domain has " +
+        std::to_string(domain.size()) + " values, expected at most " +
+        std::to_string(T::cardinality));
+  }
+
+  for (unsigned int i = 0; i < domain.size(); i++) {
+    if (static_cast<int>(T(i).raw_value()) != domain[i]) {
+      throw CorpusError("Corpus " + T::type_name + " domain doesn't match: " +
+          std::to_string(domain[i]) + " at index " + std::to_string(i));
+    }
+  }
+}
+
+template<class T>
+void check_code(unsigned char code) {
+  if (code >= T::cardinality) {
+    throw CorpusError("Bad " + T::type_name + " code in corpus: " +
+        std::to_string(code));
+  }
+}
+
+/***************************************************
+ * Streaming JSON parsing
+ ***************************************************/
+
+// a minimal pull parser for JSON, reading straight from a stream. values are
+// consumed as they are read, so nothing larger than a single chorale is ever
+// held in memory.
+class JsonStream {
+  std::streambuf *buf;
+  size_t offset; // for error messages
+
+  using traits = std::char_traits<char>;
+
+  static bool is_space(int c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+  }
+
+  static bool is_number_char(int c) {
+    return std::isdigit(c) || c == '-' || c == '+' || c == '.' || 
+      c == 'e' || c == 'E';
+  }
+
+  int get() {
+    int c = buf->sbumpc();
+    if (c != traits::eof())
+      offset++;
+    return c;
+  }
+
+  void skip_ws() {
+    while (is_space(buf->sgetc()))
+      get();
+  }
+
+  void append_utf8(std::string &str, unsigned int cp) {
+    if (cp < 0x80)
+      str += static_cast<char>(cp);
+    else if (cp < 0x800) {
+      str += static_cast<char>(0xc0 | (cp >> 6));
+      str += static_cast<char>(0x80 | (cp & 0x3f));
+    }
+    else {
+      str += static_cast<char>(0xe0 | (cp >> 12));
+      str += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+      str += static_cast<char>(0x80 | (cp & 0x3f));
+    }
+  }
+
+  void read_literal(const char *lit) {
+    for (; *lit; lit++) {
+      if (get() != *lit)
+        fail("bad literal");
+    }
+  }
+
+public:
+  explicit JsonStream(std::istream &is) : buf(is.rdbuf()), offset(0) {}
+
+  void fail(const std::string &what) const {
+    throw CorpusError("JSON corpus: " + what + 
+        " (at byte " + std::to_string(offset) + ")");
+  }
+
+  int peek() {
+    skip_ws();
+    return buf->sgetc();
+  }
+
+  void expect(char c) {
+    skip_ws();
+    if (get() != c)
+      fail(std::string("expected '") + c + "'");
+  }
+
+  bool at_end() { return peek() == traits::eof(); }
+
+  std::string read_string() {
+    expect('"');
+    std::string result;
+    while (true) {
+      int c = get();
+      if (c == traits::eof())
+        fail("unterminated string");
+      if (c == '"')
+        return result;
+      if (c != '\\') {
+        result += static_cast<char>(c);
+        continue;
+      }
+
+      switch (c = get()) {
+        case '"': case '\\': case '/': result += static_cast<char>(c); break;
+        case 'b': result += '\b'; break;
+        case 'f': result += '\f'; break;
+        case 'n': result += '\n'; break;
+        case 'r': result += '\r'; break;
+        case 't': result += '\t'; break;
+        case 'u': {
+          unsigned int cp = 0;
+          for (int i = 0; i < 4; i++) {
+            int h = get();
+            if (!std::isxdigit(h))
+              fail("bad unicode escape");
+            cp = cp * 16 + 
+              (std::isdigit(h) ? h - '0' : std::tolower(h) - 'a' + 10);
+          }
+          append_utf8(result, cp);
+          break;
+        }
+        default:
+          fail("bad escape in string");
+      }
+    }
+  }
+
+  long read_int() {
+    skip_ws();
+    bool negative = false;
+    if (buf->sgetc() == '-') {
+      negative = true;
+      get();
+    }
+
+    if (!std::isdigit(buf->sgetc()))
+      fail("expected an integer");
+
+    long result = 0;
+    while (std::isdigit(buf->sgetc()))
+      result = result * 10 + (get() - '0');
+
+    int c = buf->sgetc();
+    if (c == '.' || c == 'e' || c == 'E')
+      fail("expected an integer");
+
+    return negative ? -result : result;
+  }
+
+  // calls on_member(key) with the stream positioned at each member's value,
+  // which on_member must consume
+  template<class F>
+  void read_object(F on_member) {
+    expect('{');
+    if (peek() == '}') {
+      get();
+      return;
+    }
+
+    while (true) {
+      auto key = read_string();
+      expect(':');
+      on_member(key);
+
+      skip_ws();
+      int c = get();
+      if (c == '}')
+        return;
+      if (c != ',')
+        fail("expected ',' or '}'");
+    }
+  }
+
+  // calls on_element() with the stream positioned at each element
+  template<class F>
+  void read_array(F on_element) {
+    expect('[');
+    if (peek() == ']') {
+      get();
+      return;
+    }
+
+    while (true) {
+      on_element();
+
+      skip_ws();
+      int c = get();
+      if (c == ']')
+        return;
+      if (c != ',')
+        fail("expected ',' or ']'");
+    }
+  }
+
+  void skip_value() {
+    switch (peek()) {
+      case '{': 
+        read_object([this](const std::string &) { skip_value(); });
+        break;
+      case '[':
+        read_array([this]() { skip_value(); });
+        break;
+      case '"':
+        read_string();
+        break;
+      case 't': read_literal("true"); break;
+      case 'f': read_literal("false"); break;
+      case 'n': read_literal("null"); break;
+      default: {
+        bool any = false;
+        while (is_number_char(buf->sgetc())) {
+          get();
+          any = true;
+        }
+        if (!any)
+          fail("unexpected character");
+      }
+    }
+  }
+};
+
+std::vector<int> read_json_domain(JsonStream &js) {
+  std::vector<int> domain;
+  js.read_array([&]() { domain.push_back(js.read_int()); });
+  return domain;
+}
+
+CorpusDomains read_metadata(JsonStream &js) {
+  CorpusDomains domains;
+  js.read_object([&](const std::string &key) {
+    if (key == "pitch_domain")
+      domains.pitch = read_json_domain(js);
+    else if (key == "duration_domain")
+      domains.duration = read_json_domain(js);
+    else if (key == "keysig_domain")
+      domains.keysig = read_json_domain(js);
+    else if (key == "timesig_domain")
+      domains.timesig = read_json_domain(js);
+    else if (key == "rest_domain")
+      domains.rest = read_json_domain(js);
+    else
+      js.skip_value();
+  });
+  return domains;
+}
+
+// notes are given as (pitch, offset, duration) triples
+using RawNote = std::array<unsigned int, 3>;
+
+// the code of the T with the given raw value (e.g. a MIDI pitch, or a length
+// in semiquavers), which must be in T's domain
+template<class T>
+unsigned int code_for(long raw) {
+  for (unsigned int c = 0; c < T::cardinality; c++)
+    if (static_cast<int>(T(c).raw_value()) == raw)
+      return c;
+
+  throw CorpusError("JSON corpus: bad " + T::type_name + " " +
+      std::to_string(raw));
+}
+
+std::vector<ChoraleEvent> 
+make_chorale(int num_sharps, unsigned int bar_length, 
+             const std::vector<RawNote> &notes) {
+  if (notes.size() < 2)
+    throw CorpusError("JSON corpus: chorale has fewer than two notes");
+
+  // (the last time signature code is unused, and has a bar length of 0)
+  if (bar_length == 0)
+    throw CorpusError("JSON corpus: bad timesig 0");
+
+  ChoraleKeySig ks(code_for<ChoraleKeySig>(num_sharps));
+  ChoraleTimeSig ts(code_for<ChoraleTimeSig>(bar_length));
+
+  std::vector<ChoraleEvent> chorale_events;
+  chorale_events.reserve(notes.size());
+
+  // the rest before the first note is its offset
+  unsigned long prev_end = 0;
+  for (const auto &note : notes) {
+    unsigned long offset = note[1];
+    if (offset < prev_end) {
+      throw CorpusError("JSON corpus: note at offset " + 
+          std::to_string(offset) + " overlaps the one before it");
+    }
+
+    chorale_events.push_back(ChoraleEvent(ks, ts,
+      ChoralePitch(code_for<ChoralePitch>(note[0])),
+      ChoraleDuration(code_for<ChoraleDuration>(note[2])),
+      ChoraleRest(code_for<ChoraleRest>(offset - prev_end))
+    ));
+
+    prev_end = offset + note[2];
+  }
+
+  return chorale_events;
+}
+
+void read_chorale(JsonStream &js, CorpusPart part, const ChoraleSink &sink) {
+  int num_sharps = 0;
+  unsigned int bar_length = 0;
+  bool have_keysig = false, have_timesig = false;
+  std::vector<RawNote> notes;
+
+  auto read_unsigned = [&js]() {
+    auto x = js.read_int();
+    if (x < 0)
+      js.fail("unexpected negative value");
+    return static_cast<unsigned int>(x);
+  };
+
+  js.read_object([&](const std::string &key) {
+    if (key == "notes") {
+      js.read_array([&]() {
+        RawNote note;
+        unsigned int i = 0;
+        js.read_array([&]() {
+          if (i == note.size())
+            js.fail("notes must be (pitch, offset, duration) triples");
+          note[i++] = read_unsigned();
+        });
+        if (i != note.size())
+          js.fail("notes must be (pitch, offset, duration) triples");
+        notes.push_back(note);
+      });
+    }
+    else if (key == "key_sig_sharps") {
+      num_sharps = js.read_int();
+      have_keysig = true;
+    }
+    else if (key == "time_sig_amt") {
+      bar_length = read_unsigned();
+      have_timesig = true;
+    }
+    else
+      js.skip_value();
+  });
+
+  if (!have_keysig || !have_timesig || notes.empty())
+    js.fail("chorale is missing its notes or key/time signature");
+
+  sink(part, make_chorale(num_sharps, bar_length, notes));
+}
+
+/***************************************************
+ * Binary reading/writing
+ ***************************************************/
+
+// read-only memory map of a whole file
+class MappedFile {
+  void *addr;
+  size_t length;
+
+public:
+  explicit MappedFile(const std::string &path) : addr(MAP_FAILED), length(0) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw CorpusError("Couldn't open corpus file " + path);
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      length = st.st_size;
+      addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+
+    if (addr == MAP_FAILED)
+      throw CorpusError("Couldn't map corpus file " + path);
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  ~MappedFile() { munmap(addr, length); }
+
+  const unsigned char *begin() const {
+    return static_cast<const unsigned char *>(addr);
+  }
+  const unsigned char *end() const { return begin() + length; }
+};
+
+// bounds-checked cursor over the bytes of a binary corpus
+class ByteReader {
+  const unsigned char *pos;
+  const unsigned char *const end;
+
+public:
+  ByteReader(const unsigned char *b, const unsigned char *e) : pos(b), end(e) {}
+
+  const unsigned char *take(size_t n) {
+    if ((size_t)(end - pos) < n)
+      throw CorpusError("Binary corpus is truncated");
+    auto result = pos;
+    pos += n;
+    return result;
+  }
+
+  template<class T>
+  T read() {
+    T value;
+    std::memcpy(&value, take(sizeof(T)), sizeof(T));
+    return value;
+  }
+
+  bool at_end() const { return pos == end; }
+};
+
+std::vector<int> read_domain(ByteReader &reader) {
+  auto size = reader.read<uint32_t>();
+
+  // take the values before allocating, so that a corrupt size can't ask for
+  // more memory than the file could fill
+  auto bytes = reader.take(size * sizeof(int32_t));
+  std::vector<int> domain(size);
+  for (auto &value : domain) {
+    int32_t v;
+    std::memcpy(&v, bytes, sizeof(v));
+    bytes += sizeof(v);
+    value = v;
+  }
+  return domain;
+}
+
+// calls on_piece(keysig, timesig, note_codes, num_notes) for each piece
+template<class F>
+void read_subcorpus(ByteReader &reader, F on_piece) {
+  auto num_chorales = reader.read<uint32_t>();
+  for (uint32_t i = 0; i < num_chorales; i++) {
+    auto num_notes = reader.read<uint32_t>();
+    auto ks = reader.read<uint8_t>();
+    auto ts = reader.read<uint8_t>();
+    on_piece(ks, ts, reader.take(3 * (size_t)num_notes), num_notes);
+  }
+}
+
+// reads the header of a binary corpus, up to the start of the training set
+CorpusDomains read_binary_header(ByteReader &reader, const std::string &path) {
+  if (std::memcmp(reader.take(sizeof(binary_magic)),
+                  binary_magic, sizeof(binary_magic)) != 0)
+    throw CorpusError(path + " is not a binary corpus");
+
+  auto version = reader.read<uint32_t>();
+  if (version != binary_version) {
+    throw CorpusError("Unsupported binary corpus version (or byte order): " +
+        std::to_string(version));
+  }
+
+  CorpusDomains domains;
+  domains.pitch    = read_domain(reader);
+  domains.duration = read_domain(reader);
+  domains.keysig   = read_domain(reader);
+  domains.timesig  = read_domain(reader);
+  domains.rest     = read_domain(reader);
+  domains.validate();
+  return domains;
+}
+
+template<class T>
+void write_value(std::ostream &os, T value) {
+  os.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+void write_domain(std::ostream &os, const std::vector<int> &domain) {
+  write_value<uint32_t>(os, domain.size());
+  for (auto value : domain)
+    write_value<int32_t>(os, value);
+}
+
+void write_subcorpus(std::ostream &os, const ChoraleCorpus &subcorp) {
+  write_value<uint32_t>(os, subcorp.size());
+  for (const auto &chorale : subcorp) {
+    write_value<uint32_t>(os, chorale.size());
+    if (chorale.empty()) {
+      write_value<uint8_t>(os, 0);
+      write_value<uint8_t>(os, 0);
+      continue;
+    }
+
+    write_value<uint8_t>(os, chorale.front().keysig.encode());
+    write_value<uint8_t>(os, chorale.front().timesig.encode());
+    for (const auto &e : chorale) {
+      write_value<uint8_t>(os, e.pitch.encode());
+      write_value<uint8_t>(os, e.duration.encode());
+      write_value<uint8_t>(os, e.rest.encode());
+    }
+  }
+}
+
+} // anonymous namespace
+
+/***************************************************
+ * FlatCorpus implementation
+ ***************************************************/
+
+std::vector<ChoraleEvent> FlatCorpus::PieceView::events() const {
+  std::vector<ChoraleEvent> result;
+  result.reserve(size());
+  for (size_t i = 0; i < size(); i++)
+    result.push_back((*this)[i]);
+  return result;
+}
+
+FlatCorpus::FlatCorpus(const ChoraleCorpus &corpus) : offsets{0} {
+  size_t total = 0;
+  for (const auto &piece : corpus)
+    total += piece.size();
+  notes.reserve(total);
+
+  for (const auto &piece : corpus)
+    push_back(piece);
+}
+
+void FlatCorpus::push_back(const std::vector<ChoraleEvent> &piece) {
+  uint8_t ks = piece.empty() ? 0 : piece.front().keysig.encode();
+  uint8_t ts = piece.empty() ? 0 : piece.front().timesig.encode();
+
+  for (const auto &e : piece) {
+    assert(e.keysig.encode() == ks && e.timesig.encode() == ts);
+    notes.push_back(Note { 
+      static_cast<uint8_t>(e.pitch.encode()), 
+      static_cast<uint8_t>(e.duration.encode()), 
+      static_cast<uint8_t>(e.rest.encode()) 
+    });
+  }
+
+  keysigs.push_back(ks);
+  timesigs.push_back(ts);
+  offsets.push_back(notes.size());
+}
+
+void FlatCorpus::append_codes(uint8_t ks, uint8_t ts, 
+    const unsigned char *note_codes, size_t num_notes) {
+  // check everything first so that a bad piece leaves the corpus unchanged
+  check_code<ChoraleKeySig>(ks);
+  check_code<ChoraleTimeSig>(ts);
+  for (size_t i = 0; i < num_notes; i++) {
+    const unsigned char *codes = note_codes + 3*i;
+    check_code<ChoralePitch>(codes[0]);
+    check_code<ChoraleDuration>(codes[1]);
+    check_code<ChoraleRest>(codes[2]);
+  }
+
+  for (size_t i = 0; i < num_notes; i++) {
+    const unsigned char *codes = note_codes + 3*i;
+    notes.push_back(Note { codes[0], codes[1], codes[2] });
+  }
+
+  keysigs.push_back(ks);
+  timesigs.push_back(ts);
+  offsets.push_back(notes.size());
+}
+
+ChoraleCorpus FlatCorpus::unpack() const {
+  ChoraleCorpus result;
+  result.reserve(size());
+  for (size_t i = 0; i < size(); i++)
+    result.push_back((*this)[i].events());
+  return result;
+}
+
+void CorpusDomains::validate() const {
+  validate_domain<ChoralePitch>(pitch);
+  validate_domain<ChoraleDuration>(duration);
+  validate_domain<ChoraleKeySig>(keysig);
+  validate_domain<ChoraleTimeSig>(timesig);
+  validate_domain<ChoraleRest>(rest);
+}
+
+CorpusDomains stream_json_corpus(std::istream &is, const ChoraleSink &sink) {
+  JsonStream js(is);
+  CorpusDomains domains;
+  bool have_metadata = false;
+
+  js.read_object([&](const std::string &key) {
+    if (key == "metadata") {
+      domains = read_metadata(js);
+      domains.validate();
+      have_metadata = true;
+    }
+    else if (key == "corpus") {
+      js.read_object([&](const std::string &part_key) {
+        if (part_key == "train")
+          js.read_array([&]() { read_chorale(js, CorpusPart::train, sink); });
+        else if (part_key == "validate")
+          js.read_array([&]() { read_chorale(js, CorpusPart::test, sink); });
+        else
+          js.skip_value();
+      });
+    }
+    else
+      js.skip_value();
+  });
+
+  if (!js.at_end())
+    js.fail("trailing data");
+  if (!have_metadata)
+    js.fail("no metadata");
+
+  return domains;
+}
+
+ChoraleDataset load_json_corpus(const std::string &path) {
+  std::ifstream corpus_file(path);
+  if (!corpus_file)
+    throw CorpusError("Couldn't open corpus file " + path);
+
+  ChoraleDataset result;
+  result.domains = stream_json_corpus(corpus_file, 
+    [&result](CorpusPart part, std::vector<ChoraleEvent> &&chorale) {
+      auto &subcorp = (part == CorpusPart::train) ? result.train : result.test;
+      subcorp.push_back(std::move(chorale));
+    });
+
+  return result;
+}
+
+FlatDataset load_binary_flat_corpus(const std::string &path) {
+  MappedFile file(path);
+  ByteReader reader(file.begin(), file.end());
+
+  FlatDataset result;
+  result.domains = read_binary_header(reader, path);
+
+  for (auto subcorp : { &result.train, &result.test }) {
+    read_subcorpus(reader, [subcorp](uint8_t ks, uint8_t ts, 
+          const unsigned char *note_codes, size_t num_notes) {
+      subcorp->append_codes(ks, ts, note_codes, num_notes);
+    });
+  }
+
+  if (!reader.at_end())
+    throw CorpusError("Trailing data in binary corpus " + path);
+
+  return result;
+}
+
+CorpusDomains 
+stream_binary_corpus(const std::string &path, const ChoraleSink &sink) {
+  MappedFile file(path);
+  ByteReader reader(file.begin(), file.end());
+  auto domains = read_binary_header(reader, path);
+
+  for (auto part : { CorpusPart::train, CorpusPart::test }) {
+    read_subcorpus(reader, [part, &sink](uint8_t ks, uint8_t ts, 
+          const unsigned char *note_codes, size_t num_notes) {
+      FlatCorpus piece;
+      piece.append_codes(ks, ts, note_codes, num_notes);
+      sink(part, piece[0].events());
+    });
+  }
+
+  if (!reader.at_end())
+    throw CorpusError("Trailing data in binary corpus " + path);
+
+  return domains;
+}
+
+ChoraleDataset load_binary_corpus(const std::string &path) {
+  auto flat = load_binary_flat_corpus(path);
+  ChoraleDataset result;
+  result.domains = std::move(flat.domains);
+  result.train = flat.train.unpack();
+  result.test = flat.test.unpack();
+  return result;
+}
+
+FlatDataset load_json_flat_corpus(const std::string &path) {
+  std::ifstream corpus_file(path);
+  if (!corpus_file)
+    throw CorpusError("Couldn't open corpus file " + path);
+
+  FlatDataset result;
+  result.domains = stream_json_corpus(corpus_file, 
+    [&result](CorpusPart part, std::vector<ChoraleEvent> &&chorale) {
+      auto &subcorp = (part == CorpusPart::train) ? result.train : result.test;
+      subcorp.push_back(chorale);
+    });
+
+  return result;
+}
+
+void write_binary_corpus(const std::string &path, const ChoraleDataset &data) {
+  data.domains.validate();
+
+  std::ofstream os(path, std::ios::binary);
+  if (!os)
+    throw CorpusError("Couldn't open " + path + " for writing");
+
+  os.write(binary_magic, sizeof(binary_magic));
+  write_value<uint32_t>(os, binary_version);
+
+  write_domain(os, data.domains.pitch);
+  write_domain(os, data.domains.duration);
+  write_domain(os, data.domains.keysig);
+  write_domain(os, data.domains.timesig);
+  write_domain(os, data.domains.rest);
+
+  write_subcorpus(os, data.train);
+  write_subcorpus(os, data.test);
+
+  if (!os)
+    throw CorpusError("Error writing binary corpus " + path);
+}
@@ -0,0 +1,180 @@
+#ifndef AJC_HGUARD_CORPUS
+#define AJC_HGUARD_CORPUS
+
+#include "chorale.hpp"
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/* Loading the chorale corpus.
+ *
+ * The corpus is prepared by script/prepare_chorales.py as a JSON file with a
+ * training and a validation set. The JSON is parsed as a stream (without
+ * building a DOM), and chorales can be handed on one at a time as they are
+ * read, so a corpus never needs to be held in memory all at once.
+ *
+ * Parsing still takes up most of the startup time of the programs in play/, so
+ * the corpus can instead be converted (with play/corpus2bin) to a pre-encoded
+ * binary format. The binary file is memory-mapped and unpacked directly into
+ * ChoraleEvents.
+ *
+ * Binary format (all integers are in host byte order):
+ *  - magic "P2CB", then a uint32 format version.
+ *  - the basic type domains from the JSON metadata, in the order pitch,
+ *    duration, keysig, timesig, rest: each is a uint32 size followed by that
+ *    many int32 values.
+ *  - the training and then the validation set: each is a uint32 number of
+ *    chorales. Each chorale is a uint32 number of notes, uint8 keysig and
+ *    timesig codes, then one (pitch, duration, rest) triple of uint8 codes per
+ *    note.
+ */
+
+using ChoraleCorpus = std::vector<std::vector<ChoraleEvent>>;
+
+struct CorpusError : public std::runtime_error {
+  CorpusError(std::string msg) :
+    std::runtime_error(msg) {}
+};
+
+// the domains of the basic types as listed in the corpus metadata. event codes
+// are indices into these, so they must agree with the chorale types.
+struct CorpusDomains {
+  std::vector<int> pitch;
+  std::vector<int> duration;
+  std::vector<int> keysig;
+  std::vector<int> timesig;
+  std::vector<int> rest;
+
+  void validate() const; // throws CorpusError on a mismatch
+};
+
+/* FlatCorpus
+ *
+ * A compact, contiguous alternative to ChoraleCorpus. A ChoraleEvent is five
+ * CodedEvents (each with its own vtable pointer), and each piece is a separate
+ * allocation, whereas here all of the notes of all of the pieces are packed
+ * into a single array of (pitch, duration, rest) codes. Pieces are delimited by
+ * offsets into that array (as in a CSR matrix), and the key and time signatures
+ * are stored once per piece.
+ *
+ * Pieces are accessed through lightweight views, which produce ChoraleEvents on
+ * the fly (or a whole std::vector<ChoraleEvent> with events(), e.g. for
+ * ChoraleMVS::learn). Going through the corpus piece by piece then just streams
+ * through memory. */
+class FlatCorpus {
+  struct Note {
+    uint8_t pitch;
+    uint8_t duration;
+    uint8_t rest;
+  };
+
+  std::vector<Note> notes;
+  std::vector<size_t> offsets; // piece i is notes[offsets[i], offsets[i+1])
+  std::vector<uint8_t> keysigs;
+  std::vector<uint8_t> timesigs;
+
+public:
+  class PieceView {
+    const FlatCorpus *corpus;
+    size_t piece;
+
+  public:
+    class const_iterator : 
+      public std::iterator<std::input_iterator_tag, ChoraleEvent> {
+      const FlatCorpus *corpus;
+      size_t piece;
+      size_t pos;
+
+    public:
+      const_iterator(const FlatCorpus *c, size_t i, size_t p) : 
+        corpus(c), piece(i), pos(p) {}
+      ChoraleEvent operator*() const { return PieceView(corpus, piece)[pos]; }
+      const_iterator &operator++() { pos++; return *this; }
+      bool operator==(const const_iterator &o) const { return pos == o.pos; }
+      bool operator!=(const const_iterator &o) const { return pos != o.pos; }
+    };
+
+    PieceView(const FlatCorpus *c, size_t i) : corpus(c), piece(i) {}
+
+    size_t size() const { 
+      return corpus->offsets[piece + 1] - corpus->offsets[piece];
+    }
+
+    ChoraleKeySig keysig() const { return corpus->keysigs[piece]; }
+    ChoraleTimeSig timesig() const { return corpus->timesigs[piece]; }
+
+    ChoraleEvent operator[](size_t i) const {
+      const auto &note = corpus->notes[corpus->offsets[piece] + i];
+      return ChoraleEvent(keysig(), timesig(), 
+        ChoralePitch(note.pitch), 
+        ChoraleDuration(note.duration), 
+        ChoraleRest(note.rest));
+    }
+
+    const_iterator begin() const { 
+      return const_iterator(corpus, piece, 0); 
+    }
+    const_iterator end() const { 
+      return const_iterator(corpus, piece, size()); 
+    }
+
+    std::vector<ChoraleEvent> events() const;
+  };
+
+  FlatCorpus() : offsets{0} {}
+  explicit FlatCorpus(const ChoraleCorpus &corpus);
+
+  size_t size() const { return keysigs.size(); }
+  size_t num_events() const { return notes.size(); }
+  PieceView operator[](size_t i) const { return PieceView(this, i); }
+
+  // every event in a piece must have the same key and time signature
+  void push_back(const std::vector<ChoraleEvent> &piece);
+
+  // appends a piece given as the raw codes of the binary format (see above).
+  // throws CorpusError if any of the codes are out of range.
+  void append_codes(uint8_t keysig, uint8_t timesig, 
+                    const unsigned char *note_codes, size_t num_notes);
+
+  ChoraleCorpus unpack() const;
+};
+
+struct ChoraleDataset {
+  CorpusDomains domains;
+  ChoraleCorpus train;
+  ChoraleCorpus test;
+};
+
+struct FlatDataset {
+  CorpusDomains domains;
+  FlatCorpus train;
+  FlatCorpus test;
+};
+
+// which part of the dataset a chorale belongs to
+enum class CorpusPart { train, test };
+
+using ChoraleSink = 
+  std::function<void(CorpusPart, std::vector<ChoraleEvent> &&)>;
+
+// reads a JSON corpus incrementally, passing each chorale to the sink as soon
+// as it has been parsed. returns the metadata domains (which are validated as
+// soon as they are read, i.e. before any chorales if the metadata comes first,
+// as it does in the files written by script/prepare_chorales.py).
+CorpusDomains stream_json_corpus(std::istream &is, const ChoraleSink &sink);
+
+// the same for a binary corpus
+CorpusDomains 
+stream_binary_corpus(const std::string &path, const ChoraleSink &sink);
+
+ChoraleDataset load_json_corpus(const std::string &path);
+ChoraleDataset load_binary_corpus(const std::string &path);
+FlatDataset load_json_flat_corpus(const std::string &path);
+FlatDataset load_binary_flat_corpus(const std::string &path);
+void write_binary_corpus(const std::string &path, const ChoraleDataset &data);
+
+#endif
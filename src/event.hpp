@@ -3,9 +3,36 @@
 
 #include <vector>
 #include <array>
+#include <utility>
 #include <string>
 #include <cassert>
 
+/* CodeView
+ *
+ * A lightweight, non-owning view onto a contiguous sequence of encoded events,
+ * e.g. one column of a cache of lifted features (see ChoraleFeatures). */
+class CodeView {
+private:
+  const unsigned int *codes;
+  size_t length;
+
+public:
+  size_t size() const { return length; }
+  bool empty() const { return length == 0; }
+  unsigned int operator[](size_t i) const { return codes[i]; }
+  const unsigned int *begin() const { return codes; }
+  const unsigned int *end() const { return codes + length; }
+
+  // view of the last n codes (or all of them if there are fewer than n)
+  CodeView tail(size_t n) const {
+    return (n >= length) ? *this : CodeView(codes + length - n, n);
+  }
+
+  CodeView(const unsigned int *cs, size_t len) : codes(cs), length(len) {}
+  CodeView(const std::vector<unsigned int> &v) : 
+    codes(v.data()), length(v.size()) {}
+};
+
 class SequenceEvent {
 public:
   constexpr static unsigned int cardinality = 0;
@@ -78,6 +105,63 @@ public:
     return result;
   }
 
+  // like zip_tail, but operates directly on encoded events and only gives the
+  // last n pairs of the result
+  static std::vector<unsigned int>
+  zip_tail_codes(const CodeView &vec_l, const CodeView &vec_r, size_t n) {
+    assert(abs((int)vec_l.size() - (int)vec_r.size()) <= 1);
+    auto result_len = std::min(n, std::min(vec_l.size(), vec_r.size()));
+    auto l = vec_l.tail(result_len);
+    auto r = vec_r.tail(result_len);
+
+    std::vector<unsigned int> result(result_len);
+    for (unsigned i = 0; i < result_len; i++)
+      result[i] = l[i] + T1::cardinality * r[i];
+
+    return result;
+  }
+
+  // sums out the left type of a joint distribution over pairs (indexed by
+  // code). since pairs are encoded as left + T1::cardinality * right, each
+  // value of the right type owns a contiguous block of T1::cardinality values
+  // in the joint, so marginalising is just a strided reduction over the array
+  static std::array<double, T2::cardinality>
+  marginalise_left(const std::array<double, cardinality> &joint) {
+    std::array<double, T2::cardinality> result;
+    const double *block = joint.data();
+    for (unsigned int r = 0; r < T2::cardinality; r++) {
+      double sum = 0.0;
+      for (unsigned int l = 0; l < T1::cardinality; l++)
+        sum += block[l];
+
+      result[r] = sum;
+      block += T1::cardinality;
+    }
+
+    return result;
+  }
+
+  // the same reduction over a sparse joint: the pairs in `seen` are listed
+  // explicitly (by code) and every other pair has probability `unseen`, so we
+  // only touch the observed pairs and count how many hidden values are left
+  // over for each value of the right type
+  static std::array<double, T2::cardinality>
+  marginalise_left(const std::vector<std::pair<unsigned int, double>> &seen,
+                   double unseen) {
+    std::array<double, T2::cardinality> result{{0.0}};
+    std::array<unsigned int, T2::cardinality> num_seen{{0}};
+    for (const auto &kv : seen) {
+      unsigned int r = kv.first / T1::cardinality;
+      result[r] += kv.second;
+      num_seen[r]++;
+    }
+
+    for (unsigned int r = 0; r < T2::cardinality; r++)
+      result[r] += (T1::cardinality - num_seen[r]) * unseen;
+
+    return result;
+  }
+
   unsigned int encode() const override {
     return coded;
   }
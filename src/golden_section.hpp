@@ -0,0 +1,42 @@
+#ifndef AJC_HGUARD_GOLDEN_SECTION
+#define AJC_HGUARD_GOLDEN_SECTION
+
+#include <cmath>
+#include <functional>
+
+/* golden_section_minimise
+ *
+ * Minimises a unimodal function on [lo, hi] to within tol using golden-section
+ * search, and returns the minimising argument. Each step shrinks the interval
+ * by a factor of 1/phi and reuses one of the previous step's evaluations, so
+ * f is evaluated only about log((hi - lo) / tol) / log(phi) times. */
+inline double golden_section_minimise(const std::function<double(double)> &f,
+    double lo, double hi, double tol) {
+  const double inv_phi = (std::sqrt(5.0) - 1.0) / 2.0;
+
+  double a = hi - inv_phi * (hi - lo);
+  double b = lo + inv_phi * (hi - lo);
+  double f_a = f(a);
+  double f_b = f(b);
+
+  while (hi - lo > tol) {
+    if (f_a < f_b) {
+      hi = b;
+      b = a;
+      f_b = f_a;
+      a = hi - inv_phi * (hi - lo);
+      f_a = f(a);
+    }
+    else {
+      lo = a;
+      a = b;
+      f_a = f_b;
+      b = lo + inv_phi * (hi - lo);
+      f_b = f(b);
+    }
+  }
+
+  return (lo + hi) / 2.0;
+}
+
+#endif
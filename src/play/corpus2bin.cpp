@@ -0,0 +1,35 @@
+#include <iostream>
+
+#include "corpus.hpp"
+
+// converts a JSON corpus (as prepared by script/prepare_chorales.py) into the
+// binary format described in corpus.hpp
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    std::cerr << "usage: " << argv[0] << " <corpus.json> <corpus.bin>" 
+      << std::endl;
+    return 1;
+  }
+
+  try {
+    auto data = load_json_corpus(argv[1]);
+    write_binary_corpus(argv[2], data);
+
+    // check the conversion round-trips
+    auto check = load_binary_corpus(argv[2]);
+    if (check.train.size() != data.train.size() || 
+        check.test.size() != data.test.size()) {
+      std::cerr << "error: binary corpus doesn't match the original" 
+        << std::endl;
+      return 1;
+    }
+
+    std::cout << "wrote " << data.train.size() << " training and " 
+      << data.test.size() << " validation chorales to " << argv[2] 
+      << std::endl;
+  }
+  catch (const CorpusError &e) {
+    std::cerr << "error: " << e.what() << std::endl;
+    return 1;
+  }
+}
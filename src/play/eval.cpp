@@ -5,82 +5,35 @@
 #include "event.hpp"
 #include "chorale.hpp"
 #include "viewpoint.hpp"
+#include "prediction_cache.hpp"
+#include "corpus.hpp"
+#include "bounded_queue.hpp"
+#include "golden_section.hpp"
+#include <chrono>
+#include <exception>
+#include <random>
+#include <thread>
 
 using json = nlohmann::json;
-using corpus_t = std::vector<std::vector<ChoraleEvent>>;
+using corpus_t = ChoraleCorpus;
 
-void parse_subcorpus(
-  const json &subcorp_j,
-  corpus_t &subcorp
-) {
-  const auto num_chorales = subcorp_j.size();
-  for (unsigned int i = 0; i < num_chorales; i++) {
-    const auto &chorale_j = subcorp_j[i];
-    
-    std::vector<ChoraleEvent> chorale_events;
-
-    const auto &notes_j = chorale_j["notes"];
-    assert(notes_j.size() > 1);
-
-    const auto &first_note_j = notes_j[0];
-    unsigned int first_pitch   = first_note_j[0];
-    unsigned int prev_offset   = first_note_j[1];
-    unsigned int prev_duration = first_note_j[2];
-
-    // get key and time signatures
-    unsigned int num_sharps = chorale_j["key_sig_sharps"];
-    KeySig ks(num_sharps);
-    unsigned int bar_length = chorale_j["time_sig_amt"];
-    QuantizedDuration ts(bar_length);
-
-    chorale_events.push_back(ChoraleEvent(
-      ks, ts, MidiPitch(first_pitch), 
-      QuantizedDuration(prev_duration), 
-      QuantizedDuration(prev_offset)
-    ));
-
-    for (unsigned int j = 1; j < notes_j.size(); j++) {
-      const auto &note_j = notes_j[j];
-
-      unsigned int pitch    = note_j[0];
-      unsigned int offset   = note_j[1];
-      unsigned int duration = note_j[2];
-
-      assert(offset >= prev_offset + prev_duration);
-      auto rest_amt = offset - prev_offset - prev_duration;
-      QuantizedDuration rest_dur{rest_amt};
-
-      chorale_events.push_back(ChoraleEvent(
-        ks, ts,
-        MidiPitch(pitch), 
-        QuantizedDuration(duration), 
-        rest_amt
-      ));
-
-      prev_offset = offset;
-      prev_duration = duration;
-    }
-
-    subcorp.push_back(chorale_events);
-  }
+bool has_suffix(const std::string &str, const std::string &suffix) {
+  return str.size() >= suffix.size() && 
+    str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
 }
 
+// loads either a JSON corpus or a binary one (see play/corpus2bin.cpp)
 void parse(
   const std::string corpus_path, 
   corpus_t &train_corpus, 
   corpus_t &test_corpus
 ) {
-  std::ifstream corpus_file(corpus_path);
-  json j;
-  corpus_file >> j;
-
   std::cout << "Parsing corpus... " << std::endl << std::flush;
 
-  const auto &corpus_j = j["corpus"];
-  std::cerr << "loading train corpus" << std::endl;
-  parse_subcorpus(corpus_j["train"], train_corpus);
-  std::cerr << "loading test corpus" << std::endl;
-  parse_subcorpus(corpus_j["validate"], test_corpus);
+  auto data = has_suffix(corpus_path, ".bin") ? 
+    load_binary_corpus(corpus_path) : load_json_corpus(corpus_path);
+  train_corpus = std::move(data.train);
+  test_corpus = std::move(data.test);
 
   std::cout << "done." << std::endl;
 }
@@ -92,9 +45,91 @@ void train(const corpus_t &corpus, std::initializer_list<ChoraleMVS *> mvss) {
   }
 }
 
-void render(const std::vector<ChoraleEvent> &piece, 
-            const std::map<std::string, std::vector<double>> entropies,
-            const std::string &json_fname) {
+// shared by the training and evaluation routines below
+ThreadPool &eval_pool() {
+  static ThreadPool pool;
+  return pool;
+}
+
+/* Loads a corpus (as parse does) while training the MVSs on its training set.
+ * A parser thread passes chorales to the training thread through a bounded
+ * queue, so parsing overlaps with building the models (and the parser can't
+ * get far ahead of training). The MVSs learn each piece in parallel with each
+ * other. Each MVS still sees the pieces in corpus order, so the models are
+ * exactly the ones train() would give. */
+void parse_and_train(
+  const std::string corpus_path,
+  corpus_t &train_corpus,
+  corpus_t &test_corpus,
+  std::initializer_list<ChoraleMVS *> mvss
+) {
+  std::cout << "Parsing and training... " << std::flush;
+
+  // thrown by the parser thread to stop early if training fails
+  struct Cancelled {};
+
+  BoundedQueue<std::vector<ChoraleEvent>> queue(64);
+  std::exception_ptr parse_error;
+
+  std::thread parser([&]() {
+    auto sink = [&](CorpusPart part, std::vector<ChoraleEvent> &&chorale) {
+      if (part == CorpusPart::test)
+        test_corpus.push_back(std::move(chorale));
+      else if (!queue.push(std::move(chorale)))
+        throw Cancelled();
+    };
+
+    try {
+      if (has_suffix(corpus_path, ".bin"))
+        stream_binary_corpus(corpus_path, sink);
+      else {
+        std::ifstream corpus_file(corpus_path);
+        if (!corpus_file)
+          throw CorpusError("Couldn't open corpus file " + corpus_path);
+        stream_json_corpus(corpus_file, sink);
+      }
+    }
+    catch (const Cancelled &) {}
+    catch (...) {
+      parse_error = std::current_exception();
+    }
+
+    queue.close();
+  });
+
+  const std::vector<ChoraleMVS *> mvs_list(mvss);
+  std::vector<ChoraleEvent> piece;
+  try {
+    while (queue.pop(piece)) {
+      eval_pool().parallel_for(mvs_list.size(), [&](size_t i) {
+        mvs_list[i]->learn(piece);
+      });
+      train_corpus.push_back(std::move(piece));
+    }
+  }
+  catch (...) {
+    queue.close();
+    parser.join();
+    throw;
+  }
+
+  parser.join();
+  if (parse_error)
+    std::rethrow_exception(parse_error);
+
+  std::cout << "done." << std::endl;
+}
+
+void train(const FlatCorpus &corpus, std::initializer_list<ChoraleMVS *> mvss) {
+  for (size_t i = 0; i < corpus.size(); i++) {
+    auto piece = corpus[i].events();
+    for (auto mvs_ptr : mvss)
+      mvs_ptr->learn(piece);
+  }
+}
+
+// (pitch, onset, duration) for each note of a piece
+json notes_json(const std::vector<ChoraleEvent> &piece) {
   json notes_j;
 
   unsigned int offset = 0;
@@ -107,8 +142,14 @@ void render(const std::vector<ChoraleEvent> &piece,
     offset += duration + rest_amt;
   }
 
+  return notes_j;
+}
+
+void render(const std::vector<ChoraleEvent> &piece, 
+            const std::map<std::string, std::vector<double>> entropies,
+            const std::string &json_fname) {
   json result_j;
-  result_j["notes"] = notes_j;
+  result_j["notes"] = notes_json(piece);
 
   json entropies_j;
   for (const auto &kv : entropies) {
@@ -154,21 +195,31 @@ std::vector<EntropyMeasurement>
 evaluate_detail(const corpus_t &corpus, ChoraleMVS &mvs) {
   std::vector<EntropyMeasurement> result;
 
-  unsigned int i = 1;
+  for (const auto &entropies : mvs.corpus_entropies(corpus, eval_pool())) {
+    EntropyMeasurement point;
+    point.h_pitch    = entropies.pitch;
+    point.h_duration = entropies.duration;
+    point.h_rest     = entropies.rest;
+    result.push_back(point);
+  }
+
+  return result;
+}
 
-  for (const auto &c : corpus) {
-    if (++i % 4 == 0)
-      std::cout << "=" << std::flush;
+std::vector<EntropyMeasurement>
+evaluate_detail(const FlatCorpus &corpus, ChoraleMVS &mvs) {
+  std::vector<EntropyMeasurement> result;
 
+  auto piece_entropies = mvs.corpus_entropies(corpus.size(), 
+      [&corpus](size_t i) { return corpus[i].events(); }, eval_pool());
+  for (const auto &entropies : piece_entropies) {
     EntropyMeasurement point;
-    point.h_pitch    = mvs.avg_sequence_entropy<ChoralePitch>(c);
-    point.h_duration = mvs.avg_sequence_entropy<ChoraleDuration>(c);
-    point.h_rest     = mvs.avg_sequence_entropy<ChoraleRest>(c);
+    point.h_pitch    = entropies.pitch;
+    point.h_duration = entropies.duration;
+    point.h_rest     = entropies.rest;
     result.push_back(point);
   }
 
-  std::cout << std::endl;
-
   return result;
 }
 
@@ -184,23 +235,18 @@ evaluate(const corpus_t &corpus, double intra_bias, double inter_bias,
 
   std::vector<EntropyMeasurement> result(mvss.size());
 
-  unsigned int i = 1;
-
-  for (const auto &c : corpus) {
-    if (++i % 4 == 0)
-      std::cout << "=" << std::flush;
-
-    unsigned int j = 0;
-    for (auto mvs_ptr : mvss) {
-      result[j].h_pitch    += mvs_ptr->avg_sequence_entropy<ChoralePitch>(c);
-      result[j].h_duration += mvs_ptr->avg_sequence_entropy<ChoraleDuration>(c);
-      result[j].h_rest     += mvs_ptr->avg_sequence_entropy<ChoraleRest>(c);
-      j++;
+  unsigned int j = 0;
+  for (auto mvs_ptr : mvss) {
+    // sum in corpus order so the result is independent of scheduling
+    auto piece_entropies = mvs_ptr->corpus_entropies(corpus, eval_pool());
+    for (const auto &entropies : piece_entropies) {
+      result[j].h_pitch    += entropies.pitch;
+      result[j].h_duration += entropies.duration;
+      result[j].h_rest     += entropies.rest;
     }
+    j++;
   }
 
-  std::cout << std::endl;
-
   for (auto &point : result) {
     point.h_pitch /= corpus.size();
     point.h_duration /= corpus.size();
@@ -329,17 +375,32 @@ void MVSOptimizer::optimize(double eps_terminate,
   std::cout << "viewpoint pool: " << std::endl;
   std::cout << vps_to_string(vp_pool) << std::endl;
 
-  ChoraleMVS base_mvs(mvs_config);
-  base_mvs.add_viewpoint(&pitch_base);
-  base_mvs.add_viewpoint(&duration_base);
-  base_mvs.add_viewpoint(&rest_base);
+  // the support viewpoints for the other types don't affect the cross-entropy
+  // of T, and each viewpoint's predictions don't depend on the rest of the
+  // system. so we train each viewpoint once and cache its predictions on the
+  // test corpus, then evaluate candidate systems by re-combining these.
+  std::cout << "Caching predictions..." << std::flush;
+  PredictionCache<ChoraleEvent, T> cache(test_corp);
+  std::vector<const ChoraleMVS::Pred<T> *> to_cache { base_vp<T>() };
+  to_cache.insert(to_cache.end(), vp_pool.begin(), vp_pool.end());
+  cache.add_untrained(to_cache, train_corp, 
+      mvs_config.lt_history, mvs_config.st_history, eval_pool());
+  std::cout << "done." << std::endl;
+
+  // cache index of each pool viewpoint
+  auto cache_index = [&vp_pool](ChoraleMVS::Pred<T> *vp_ptr) -> size_t {
+    return 1 + (std::find(vp_pool.begin(), vp_pool.end(), vp_ptr) 
+                - vp_pool.begin());
+  };
 
-  train(train_corp, {&base_mvs});
+  auto xent_of = [&](const std::vector<size_t> &system) {
+    return cache.cross_entropy(system,
+        mvs_config.intra_layer_bias,
+        mvs_config.inter_layer_bias,
+        mvs_config.enable_short_term);
+  };
 
-  double prev_best_xent = evaluate(test_corp, 
-      mvs_config.intra_layer_bias, 
-      mvs_config.inter_layer_bias,
-      {&base_mvs}).at(0).project<T>();
+  double prev_best_xent = xent_of({0});
   double round_best_xent = xent_inf;
 
   std::cout << "base " 
@@ -347,51 +408,42 @@ void MVSOptimizer::optimize(double eps_terminate,
     << std::endl << std::endl;
 
   PredictorList<T> vp_stack { base_vp<T>() };
+  std::vector<size_t> system_stack { 0 };
 
   for (;;) {
     round_best_xent = xent_inf;
     ChoraleMVS::Pred<T> *best_addition = nullptr;
 
+    // candidates are any VPs which haven't already been added
+    PredictorList<T> candidates;
     for (auto vp_ptr : vp_pool) {
-      // if this VP has already been added just skip it
-      bool already_on_stack = false;
-      for (auto on_stack : vp_stack) {
-        if (on_stack == vp_ptr) {
-          already_on_stack = true;
-          break;
-        }
-      }
-      if (already_on_stack)
-        continue;
+      if (std::find(vp_stack.begin(), vp_stack.end(), vp_ptr) == vp_stack.end())
+        candidates.push_back(vp_ptr);
+    }
 
-      vp_stack.push_back(vp_ptr);
+    std::vector<double> xents(candidates.size());
+    eval_pool().parallel_for(candidates.size(), [&](size_t i) {
+      auto trial_system = system_stack;
+      trial_system.push_back(cache_index(candidates[i]));
+      xents[i] = xent_of(trial_system);
+    });
 
+    for (size_t i = 0; i < candidates.size(); i++) {
+      vp_stack.push_back(candidates[i]);
       std::cout << "Evaluating system: " 
         << vps_to_string(vp_stack) 
         << std::endl;
+      vp_stack.pop_back();
 
-      ChoraleMVS trial_mvs(mvs_config);
-      add_support_vps<T>(trial_mvs);
-      for (auto vp_ptr : vp_stack)
-        trial_mvs.add_viewpoint(vp_ptr);
-
-      train(train_corp, {&trial_mvs});
-
-      auto this_xent = evaluate(test_corp,
-          mvs_config.intra_layer_bias,
-          mvs_config.inter_layer_bias,
-          {&trial_mvs}).at(0).project<T>();
-
+      auto this_xent = xents[i];
       std::cout << "--> xent: " << this_xent << std::endl;
       if (this_xent < round_best_xent) {
         std::cout << "--> round best!" << std::endl;
         round_best_xent = this_xent;
-        best_addition = vp_ptr;
+        best_addition = candidates[i];
       }
 
       std::cout << std::endl;
-
-      vp_stack.pop_back();
     }
 
     double delta = prev_best_xent - round_best_xent;
@@ -415,68 +467,276 @@ void MVSOptimizer::optimize(double eps_terminate,
 
     // take the best addition forward
     vp_stack.push_back(best_addition);
+    system_stack.push_back(cache_index(best_addition));
     std::cout << " new system: " << vps_to_string(vp_stack) 
       << std::endl << std::endl;
     prev_best_xent = round_best_xent;
   }
 }
 
-void bias_grid_sweep(const corpus_t &corpus, ChoraleMVS &mvs, double max_intra,
-    double max_inter, double step) {
-  double min_inter, min_intra;
-  min_inter = min_intra = 0.0;
+// the viewpoints' predictions don't depend on the entropy biases, only their
+// combination does. so when looking at different biases, we compute the
+// predictions once and then just re-combine them.
+struct CachedMVS {
+  PredictionCache<ChoraleEvent, ChoralePitch> pitch_cache;
+  PredictionCache<ChoraleEvent, ChoraleDuration> dur_cache;
+  PredictionCache<ChoraleEvent, ChoraleRest> rest_cache;
+  const bool short_term;
+
+  // same result as evaluate(corpus, intra, inter, {&mvs})
+  EntropyMeasurement evaluate(double intra, double inter) const {
+    EntropyMeasurement result;
+    result.h_pitch = pitch_cache.cross_entropy(
+        pitch_cache.all_viewpoints(), intra, inter, short_term);
+    result.h_duration = dur_cache.cross_entropy(
+        dur_cache.all_viewpoints(), intra, inter, short_term);
+    result.h_rest = rest_cache.cross_entropy(
+        rest_cache.all_viewpoints(), intra, inter, short_term);
+    return result;
+  }
 
-  json inter_biases = json::array();
-  json intra_biases = json::array();
-  for (double b = min_inter; b <= max_inter; b += step)
-    inter_biases.push_back(b);
-  for (double b = min_intra; b <= max_intra; b += step)
-    intra_biases.push_back(b);
+  double total_entropy(double intra, double inter) const {
+    auto h = evaluate(intra, inter);
+    return h.h_pitch + h.h_duration + h.h_rest;
+  }
+
+  CachedMVS(const corpus_t &corpus, const ChoraleMVS &mvs) :
+    pitch_cache(corpus), dur_cache(corpus), rest_cache(corpus),
+    short_term(mvs.short_term_enabled()) {
+    std::cout << "Caching predictions..." << std::flush;
+    mvs.cache_predictions(pitch_cache, eval_pool());
+    mvs.cache_predictions(dur_cache, eval_pool());
+    mvs.cache_predictions(rest_cache, eval_pool());
+    std::cout << "done." << std::endl;
+  }
+};
 
-  double inter_steps = 1 + (max_inter - min_inter) / step;
-  double intra_steps = 1 + (max_intra - min_intra) / step;
-  unsigned int total_steps = ceil(inter_steps * intra_steps);
-  unsigned int curr_step = 1;
+// evaluates the cached MVS over the grid inter_values x intra_values (in
+// parallel) and returns the total entropies in the format of bias_sweep.json
+json bias_grid_json(const CachedMVS &cached,
+                    const std::vector<double> &inter_values,
+                    const std::vector<double> &intra_values,
+                    bool verbose) {
+  const auto total_steps = inter_values.size() * intra_values.size();
+  std::vector<EntropyMeasurement> grid(total_steps);
+
+  eval_pool().parallel_for(total_steps, [&](size_t i) {
+    auto inter = inter_values[i / intra_values.size()];
+    auto intra = intra_values[i % intra_values.size()];
+    grid[i] = cached.evaluate(intra, inter);
+  });
 
   json entropy_values = json::array();
 
-  for (double inter = min_inter; inter <= max_inter; inter += step) {
+  for (size_t i = 0; i < inter_values.size(); i++) {
     json inner_values = json::array();
-    for (double intra = min_intra; intra <= max_intra; intra += step) {
-      std::cout 
-        << std::endl
-        << "Evaluating MVSs at (inter: " << inter << ", " 
-        << "intra: " << intra << ")"
-        << " - step " << (curr_step++) << "/" << total_steps
-        << std::endl;
-
-      auto all_measurements = evaluate(corpus, intra, inter, {&mvs});
-      auto h_this_mvs = all_measurements.at(0);
-      auto h_pitch = h_this_mvs.h_pitch;
-      auto h_dur   = h_this_mvs.h_duration;
-      auto h_rest  = h_this_mvs.h_rest;
-      auto total = h_pitch + h_dur + h_rest;
-
-      std::cout << "-->    Pitch entropy: " << h_pitch << std::endl;
-      std::cout << "--> Duration entropy: " << h_dur << std::endl;
-      std::cout << "-->     Rest entropy: " << h_rest << std::endl;
-      std::cout << "-->    Total entropy: " << total << std::endl;
+    for (size_t j = 0; j < intra_values.size(); j++) {
+      const auto &point = grid[i * intra_values.size() + j];
+      auto total = point.h_pitch + point.h_duration + point.h_rest;
+
+      if (verbose) {
+        std::cout 
+          << std::endl
+          << "MVS at (inter: " << inter_values[i] << ", " 
+          << "intra: " << intra_values[j] << ")" << std::endl;
+        std::cout << "-->    Pitch entropy: " << point.h_pitch << std::endl;
+        std::cout << "--> Duration entropy: " << point.h_duration << std::endl;
+        std::cout << "-->     Rest entropy: " << point.h_rest << std::endl;
+        std::cout << "-->    Total entropy: " << total << std::endl;
+      }
 
       inner_values.push_back(total);
     }
     entropy_values.push_back(inner_values);
   }
 
-  json data_j({
-    {"inter_biases", inter_biases},
-    {"intra_biases", intra_biases},
+  return json({
+    {"inter_biases", inter_values},
+    {"intra_biases", intra_values},
     {"entropy_values", entropy_values}
   });
+}
+
+void bias_grid_sweep(const corpus_t &corpus, ChoraleMVS &mvs, double max_intra,
+    double max_inter, double step) {
+  double min_inter, min_intra;
+  min_inter = min_intra = 0.0;
+
+  std::vector<double> inter_values, intra_values;
+  for (double b = min_inter; b <= max_inter; b += step)
+    inter_values.push_back(b);
+  for (double b = min_intra; b <= max_intra; b += step)
+    intra_values.push_back(b);
+
+  CachedMVS cached(corpus, mvs);
+  auto data_j = bias_grid_json(cached, inter_values, intra_values, true);
 
   std::ofstream o("out/bias_sweep.json");
   o << data_j;
 }
 
+/* Finds the intra- and inter-layer biases in [0, max_bias] which minimise the
+ * total cross-entropy of the MVS on the given corpus. This alternates
+ * golden-section searches over each bias (holding the other fixed) until
+ * neither moves by more than tol. The entropies are computed by re-combining
+ * cached predictions, so each evaluation is cheap.
+ *
+ * Writes the entropies on a small grid around the optimum to json_fname, in
+ * the same format as bias_grid_sweep (with the optimum itself added). */
+void bias_optimise(const corpus_t &corpus, ChoraleMVS &mvs, double max_bias,
+    double tol, const std::string &json_fname) {
+  CachedMVS cached(corpus, mvs);
+
+  // (the first search is over the intra-layer bias, so it needs no start)
+  double intra = 0.0;
+  double inter = std::min(max_bias, std::max(0.0, mvs.entropy_bias));
+  unsigned int evaluations = 0;
+
+  const unsigned int max_rounds = 20;
+  for (unsigned int round = 0; round < max_rounds; round++) {
+    double prev_intra = intra, prev_inter = inter;
+
+    intra = golden_section_minimise([&](double x) {
+      evaluations++;
+      return cached.total_entropy(x, inter);
+    }, 0.0, max_bias, tol);
+
+    inter = golden_section_minimise([&](double x) {
+      evaluations++;
+      return cached.total_entropy(intra, x);
+    }, 0.0, max_bias, tol);
+
+    std::cout << "round " << round + 1 << ": (inter: " << inter 
+      << ", intra: " << intra << ") -> " 
+      << cached.total_entropy(intra, inter) << " bits" << std::endl;
+
+    if (std::abs(intra - prev_intra) < tol && std::abs(inter - prev_inter) < tol)
+      break;
+  }
+
+  auto best = cached.evaluate(intra, inter);
+  auto best_total = best.h_pitch + best.h_duration + best.h_rest;
+  std::cout << "Optimal biases found after " << evaluations 
+    << " evaluations:" << std::endl;
+  std::cout << "--> inter-layer bias: " << inter << std::endl;
+  std::cout << "--> intra-layer bias: " << intra << std::endl;
+  std::cout << "-->    Pitch entropy: " << best.h_pitch << std::endl;
+  std::cout << "--> Duration entropy: " << best.h_duration << std::endl;
+  std::cout << "-->     Rest entropy: " << best.h_rest << std::endl;
+  std::cout << "-->    Total entropy: " << best_total << std::endl;
+
+  // a grid around the optimum, for plotting. near the ends of [0, max_bias]
+  // the window is shifted (not clipped), so the axes stay evenly spaced.
+  const double width = std::min(2.0 * std::max(0.05, 10.0 * tol), max_bias);
+  const unsigned int points = 11;
+  auto axis = [&](double centre) {
+    double lo = std::min(max_bias - width, std::max(0.0, centre - width / 2));
+    std::vector<double> values;
+    for (unsigned int i = 0; i < points; i++)
+      values.push_back(lo + width * i / (points - 1));
+    return values;
+  };
+
+  auto data_j = bias_grid_json(cached, axis(inter), axis(intra), false);
+  data_j["optimum"] = {
+    {"inter_bias", inter},
+    {"intra_bias", intra},
+    {"entropy", best_total}
+  };
+
+  std::ofstream o(json_fname);
+  o << data_j;
+}
+
+/* k-fold cross-validation of an (untrained) MVS on a corpus. Rather than
+ * training a separate model for each fold, the MVS is trained once on the
+ * whole corpus and each fold is taken back out (with ChoraleMVS::unlearn) while
+ * it is being evaluated. The result is identical to training from scratch on
+ * the other folds, but costs only the fold itself to update.
+ *
+ * Folds are contiguous runs of pieces; k == corpus.size() gives leave-one-out
+ * cross-validation. The mean entropies of each fold and of all the pieces
+ * pooled together are printed and written to json_fname. The MVS is left
+ * trained on the whole corpus. */
+EntropyMeasurement cross_validate(const corpus_t &corpus, ChoraleMVS &mvs,
+    unsigned int k, const std::string &json_fname) {
+  assert(k > 0 && k <= corpus.size());
+  train(corpus, {&mvs});
+
+  std::vector<EntropyMeasurement> piece_points(corpus.size());
+  std::vector<EntropyMeasurement> fold_points(k);
+  json folds_j = json::array();
+
+  for (unsigned int f = 0; f < k; f++) {
+    const size_t begin = (f * corpus.size()) / k;
+    const size_t end = ((f + 1) * corpus.size()) / k;
+    const corpus_t fold(corpus.begin() + begin, corpus.begin() + end);
+
+    for (const auto &piece : fold)
+      mvs.unlearn(piece);
+
+    auto piece_entropies = mvs.corpus_entropies(fold, eval_pool());
+    auto &fold_point = fold_points[f];
+    for (size_t i = 0; i < fold.size(); i++) {
+      auto &point = piece_points[begin + i];
+      point.h_pitch    = piece_entropies[i].pitch;
+      point.h_duration = piece_entropies[i].duration;
+      point.h_rest     = piece_entropies[i].rest;
+      fold_point.h_pitch    += point.h_pitch;
+      fold_point.h_duration += point.h_duration;
+      fold_point.h_rest     += point.h_rest;
+    }
+
+    fold_point.h_pitch /= fold.size();
+    fold_point.h_duration /= fold.size();
+    fold_point.h_rest /= fold.size();
+
+    train(fold, {&mvs});
+
+    std::cout << "fold " << f + 1 << "/" << k << " (" << fold.size() 
+      << " pieces): pitch " << fold_point.h_pitch 
+      << ", duration " << fold_point.h_duration 
+      << ", rest " << fold_point.h_rest << std::endl;
+
+    folds_j.push_back({
+      {"pieces", fold.size()},
+      {"pitch", fold_point.h_pitch},
+      {"duration", fold_point.h_duration},
+      {"rest", fold_point.h_rest}
+    });
+  }
+
+  // sum in corpus order, as in evaluate
+  EntropyMeasurement pooled;
+  for (const auto &point : piece_points) {
+    pooled.h_pitch    += point.h_pitch;
+    pooled.h_duration += point.h_duration;
+    pooled.h_rest     += point.h_rest;
+  }
+  pooled.h_pitch /= corpus.size();
+  pooled.h_duration /= corpus.size();
+  pooled.h_rest /= corpus.size();
+
+  std::cout << k << "-fold cross-validation of " << mvs.mvs_name << ":" 
+    << std::endl;
+  std::cout << "-->    Pitch entropy: " << pooled.h_pitch << std::endl;
+  std::cout << "--> Duration entropy: " << pooled.h_duration << std::endl;
+  std::cout << "-->     Rest entropy: " << pooled.h_rest << std::endl;
+
+  json result_j;
+  result_j["folds"] = folds_j;
+  result_j["pooled"] = {
+    {"pitch", pooled.h_pitch},
+    {"duration", pooled.h_duration},
+    {"rest", pooled.h_rest}
+  };
+
+  std::ofstream o(json_fname);
+  o << result_j << std::endl;
+
+  return pooled;
+}
+
 void entropy_profile(
   ChoraleMVS &mvs,
   const std::vector<ChoraleEvent> piece,
@@ -525,6 +785,13 @@ void pathalogical(ChoraleMVS &mvs, unsigned int len) {
   entropy_profile(mvs, eg, "out/mvs_path_eg.json");
 }
 
+// generated pieces with entropies outside of these ranges are likely to be bad
+// samples (e.g. stuck repeating a note, or wandering aimlessly)
+bool plausible_entropies(const ChoraleEntropies &h) {
+  return h.pitch >= 1.6 && h.pitch <= 2.1 && 
+         h.duration >= 0.6 && h.duration <= 1.1;
+}
+
 void generate(ChoraleMVS &mvs, 
               const unsigned int len, 
               const QuantizedDuration &ts_dur,
@@ -543,17 +810,17 @@ void generate(ChoraleMVS &mvs,
     std::cout << "done." << std::endl;
 
     std::cout << "Entropy of generated piece: " << std::endl << std::flush;
-    pitch_entropy = mvs.avg_sequence_entropy<ChoralePitch>(piece);
-    dur_entropy = mvs.avg_sequence_entropy<ChoraleDuration>(piece);
-    rest_entropy = mvs.avg_sequence_entropy<ChoraleRest>(piece);
+    auto entropies = mvs.avg_sequence_entropy_all(piece);
+    pitch_entropy = entropies.pitch;
+    dur_entropy = entropies.duration;
+    rest_entropy = entropies.rest;
     std::cout << "-->    Pitch: " << pitch_entropy << std::endl;
     std::cout << "--> Duration: " << dur_entropy << std::endl;
     std::cout << "-->     Rest: " << rest_entropy << std::endl;
     std::cout << "-->    Total: "
       << (pitch_entropy + dur_entropy + rest_entropy) << std::endl;
 
-    if (pitch_entropy < 1.6 || dur_entropy < 0.6 || 
-        pitch_entropy > 2.1 || dur_entropy > 1.1) {
+    if (!plausible_entropies(entropies)) {
       std::cout << "likely bad sample, rejecting..." << std::endl;;
       continue;
     }
@@ -564,6 +831,140 @@ void generate(ChoraleMVS &mvs,
   }
 }
 
+// pieces are given up on after this many candidates (see
+// ChoraleMVS::sample_pieces)
+const unsigned int max_attempts = 1000;
+
+void report_batch(const std::vector<GeneratedChorale> &pieces, double secs) {
+  unsigned long attempts = 0;
+  size_t accepted = 0;
+  for (const auto &piece : pieces) {
+    attempts += piece.attempts;
+    accepted += piece.accepted;
+  }
+
+  std::cout << "done in " << secs << "s (accepted " 
+    << accepted << " of " << attempts << " candidates)." << std::endl;
+  if (accepted < pieces.size()) {
+    std::cout << "Gave up on " << (pieces.size() - accepted) 
+      << " pieces after " << max_attempts << " candidates." << std::endl;
+  }
+}
+
+json pieces_json(const std::vector<GeneratedChorale> &pieces) {
+  json pieces_j = json::array();
+  for (const auto &piece : pieces) {
+    pieces_j.push_back({
+      {"notes", notes_json(piece.events)},
+      {"entropies", {
+        {"pitch", piece.entropies.pitch},
+        {"duration", piece.entropies.duration},
+        {"rest", piece.entropies.rest}
+      }},
+      {"attempts", piece.attempts},
+      {"accepted", piece.accepted}
+    });
+  }
+
+  return pieces_j;
+}
+
+// generates many pieces in parallel (see ChoraleMVS::sample_pieces), keeping
+// only those with plausible entropies, and writes them all to a JSON file
+void generate_batch(const ChoraleMVS &mvs,
+                    const unsigned int num_pieces,
+                    const unsigned int len,
+                    const QuantizedDuration &ts_dur,
+                    const std::string &json_fname) {
+  xoroshiro128plus_engine engine;
+  std::random_device rdev;
+  engine.seed([&rdev]() { return rdev(); });
+
+  std::cout << "Generating " << num_pieces << " pieces of length " << len
+    << " in " << ChoraleTimeSig(ts_dur) << ".." << std::flush;
+  auto start = std::chrono::steady_clock::now();
+  auto pieces = mvs.sample_pieces(num_pieces, len, ts_dur, plausible_entropies,
+                                  max_attempts, engine, eval_pool());
+  std::chrono::duration<double> elapsed = 
+    std::chrono::steady_clock::now() - start;
+
+  report_batch(pieces, elapsed.count());
+
+  std::ofstream o(json_fname);
+  o << pieces_json(pieces) << std::endl;
+}
+
+// generates pieces of a whole number of bars which keep to the range of a
+// melody line and end on a long tonic (see ChoraleMVS::sample_constrained),
+// keeping only those with plausible entropies, and writes them to a JSON file
+void generate_constrained(const ChoraleMVS &mvs,
+                          const unsigned int num_pieces,
+                          const unsigned int len,
+                          const unsigned int num_bars,
+                          const QuantizedDuration &ts_dur,
+                          const ChoraleKeySig &keysig,
+                          const std::string &json_fname) {
+  GenerationConstraints constraints(len);
+  constraints.total_duration = num_bars * ts_dur.duration;
+
+  auto in_range = GenerationConstraints::pitches_where([](unsigned int p) {
+    return 60 <= p && p <= 79;
+  });
+  for (auto &step : constraints.steps)
+    step.pitch = in_range;
+
+  const unsigned int tonic = keysig.referent().pitch;
+  auto &last = constraints.steps.back();
+  last.pitch &= GenerationConstraints::pitches_where([tonic](unsigned int p) {
+    return p % 12 == tonic;
+  });
+  for (unsigned int d = 0; d < ChoraleDuration::cardinality; d++)
+    last.duration[d] = ChoraleDuration(d).raw_value() >= 8;
+
+  xoroshiro128plus_engine engine;
+  std::random_device rdev;
+  engine.seed([&rdev]() { return rdev(); });
+
+  std::cout << "Generating " << num_pieces << " constrained pieces of " 
+    << num_bars << " bars in " << ChoraleTimeSig(ts_dur) << ".." << std::flush;
+  auto start = std::chrono::steady_clock::now();
+  auto pieces = mvs.sample_constrained_pieces(num_pieces, keysig, ts_dur,
+    constraints, plausible_entropies, max_attempts, engine, eval_pool());
+  std::chrono::duration<double> elapsed = 
+    std::chrono::steady_clock::now() - start;
+
+  report_batch(pieces, elapsed.count());
+
+  std::ofstream o(json_fname);
+  o << pieces_json(pieces) << std::endl;
+}
+
+// writes the final beam of a beam search (see ChoraleMVS::beam_search) to a
+// JSON file, most likely piece first
+void generate_beam(const ChoraleMVS &mvs,
+                   const unsigned int len,
+                   const QuantizedDuration &ts_dur,
+                   const ChoraleKeySig &keysig,
+                   const unsigned int beam_width,
+                   const std::string &json_fname) {
+  std::cout << "Beam search (width " << beam_width << ") for pieces of length "
+    << len << " in " << ChoraleTimeSig(ts_dur) << ".." << std::flush;
+  auto start = std::chrono::steady_clock::now();
+  auto pieces = mvs.beam_search(len, ts_dur, keysig, beam_width);
+  std::chrono::duration<double> elapsed = 
+    std::chrono::steady_clock::now() - start;
+
+  const auto &best = pieces.front().entropies;
+  std::cout << "done in " << elapsed.count() << "s." << std::endl
+    << "Entropy of most likely piece: " << std::endl
+    << "-->    Pitch: " << best.pitch << std::endl
+    << "--> Duration: " << best.duration << std::endl
+    << "-->     Rest: " << best.rest << std::endl;
+
+  std::ofstream o(json_fname);
+  o << pieces_json(pieces) << std::endl;
+}
+
 struct VPPool {
   ChoraleMVS::GenVP<ChoralePitch> pitch_vp;
   ChoraleMVS::GenVP<ChoraleDuration> duration_vp;
@@ -752,7 +1153,10 @@ void seqlevel_evaluate(const std::string &json_fname,
 int main(void) {
   corpus_t train_corp;
   corpus_t test_corp;
-  parse("corpus/fixed_rests_t5.json", train_corp, test_corp);
+  // the binary corpus (made with play/corpus2bin.out) is much quicker to load
+  std::string corpus_path = "corpus/fixed_rests_t5.bin";
+  if (!std::ifstream(corpus_path))
+    corpus_path = "corpus/fixed_rests_t5.json";
 
   const QuantizedDuration three_four(12);
   const QuantizedDuration four_four(16);
@@ -773,14 +1177,6 @@ int main(void) {
 
   VPPool p;
 
-  /*
-  MVSOptimizer optimizer(full_config);
-  add_vps_to_optimizer(p, optimizer);
-
-  double eps_terminate = 0.001;
-  optimizer.optimize<ChoralePitch>(eps_terminate, train_corp, test_corp);
-  */
-
   ChoraleMVS full_mvs(full_config);
   // pitch predictors
   full_mvs.add_viewpoint(&p.pitch_vp);
@@ -803,9 +1199,24 @@ int main(void) {
   full_mvs.add_viewpoint(&p.fibxdur_p_rest);
   full_mvs.add_viewpoint(&p.fibxintref_p_rest);
 
-  std::cout << "Training... " << std::flush;
-  train(train_corp, {&lt_only, &full_mvs});
-  std::cout << "done." << std::endl;
+  // the corpora are loaded while the models train on them
+  parse_and_train(corpus_path, train_corp, test_corp, {&lt_only, &full_mvs});
+
+  /*
+  MVSOptimizer optimizer(full_config);
+  add_vps_to_optimizer(p, optimizer);
+
+  double eps_terminate = 0.001;
+  optimizer.optimize<ChoralePitch>(eps_terminate, train_corp, test_corp);
+  */
+
+  /*
+  ChoraleMVS cv_mvs(full_config);
+  cv_mvs.add_viewpoint(&p.pitch_vp);
+  cv_mvs.add_viewpoint(&p.duration_vp);
+  cv_mvs.add_viewpoint(&p.rest_vp);
+  cross_validate(train_corp, cv_mvs, 10, "out/cross_validation.json");
+  */
 
   double max_intra = 0.0;
   double max_inter = 0.0;
@@ -813,9 +1224,14 @@ int main(void) {
 
   //seqlevel_evaluate("out/seqlevel.json", test_corp, full_mvs);
   //bias_grid_sweep(test_corp, full_mvs, max_intra, max_inter, step);
+  //bias_optimise(test_corp, full_mvs, 1.0, 1e-3, "out/bias_optimum.json");
   //pathalogical(full_mvs, 30);
   entropy_profile(full_mvs, test_corp.at(88), "out/mvs_auf_meinen.json");
   //generate(full_mvs, 64, three_four, "out/gend.json");
+  //generate_batch(full_mvs, 1000, 64, three_four, "out/gend_batch.json");
+  //generate_beam(full_mvs, 64, three_four, KeySig(0), 16, "out/gend_beam.json");
+  //generate_constrained(full_mvs, 100, 48, 16, three_four, KeySig(0),
+  //                     "out/gend_constrained.json");
 }
 
 
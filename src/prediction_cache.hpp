@@ -0,0 +1,267 @@
+#ifndef AJC_HGUARD_PREDICTION_CACHE
+#define AJC_HGUARD_PREDICTION_CACHE
+
+#include "viewpoint.hpp"
+#include "thread_pool.hpp"
+#include <vector>
+#include <memory>
+#include <cmath>
+
+/* PredictionCache<EventStructure, T>
+ *
+ * Records the predictions over T made by individual viewpoints at every event
+ * of a (test) corpus, for both a long-term model (trained beforehand) and a
+ * short-term model (trained online on each piece, as in the short-term layer of
+ * a multiple viewpoint system).
+ *
+ * A viewpoint's predictions don't depend on the other viewpoints in a system,
+ * or on the entropy biases used to combine them. So once the predictions have
+ * been cached, the cross-entropy of any system built from the cached viewpoints
+ * can be computed by just re-doing the combination. This follows
+ * ChoraleVPLayer/ChoraleMVS exactly (including the order of floating point
+ * operations), so the results are identical to building, training and
+ * evaluating the system itself.
+ *
+ * Predictions are stored in flat columns with one row of T::cardinality values
+ * per event, where the pieces of the corpus are laid out one after another. */
+template<class EventStructure, class T>
+class PredictionCache {
+public:
+  using Pred = Predictor<EventStructure, T>;
+  using Features = typename EventStructure::Features;
+  using corpus_t = std::vector<std::vector<EventStructure>>;
+  using values_t = std::array<double, T::cardinality>;
+
+private:
+  // the predictions of one model (long- or short-term) of one viewpoint
+  struct Column {
+    std::vector<double> values;     // probabilities
+    std::vector<double> log_values; // log2 of the above
+    std::vector<double> norm_entropy;
+    std::vector<char> valid; // 0 where the viewpoint couldn't predict
+
+    void resize(size_t num_events) {
+      values.resize(num_events * T::cardinality);
+      log_values.resize(num_events * T::cardinality);
+      norm_entropy.resize(num_events);
+      valid.resize(num_events);
+    }
+
+    void record(size_t k, const Prediction<T> &prediction) {
+      valid[k] = (bool)prediction;
+      if (!prediction)
+        return;
+
+      norm_entropy[k] = prediction->normalised_entropy();
+      for (unsigned int e = 0; e < T::cardinality; e++) {
+        double p = prediction->probability_for_code(e);
+        values[k * T::cardinality + e] = p;
+        log_values[k * T::cardinality + e] = std::log2(p);
+      }
+    }
+  };
+
+  struct CachedViewpoint {
+    std::string name;
+    Column long_term;
+    Column short_term;
+  };
+
+  corpus_t corpus;
+  std::vector<size_t> piece_offsets; // index of the first event of each piece
+  std::vector<unsigned int> targets; // the actual event codes
+  std::vector<CachedViewpoint> viewpoints;
+
+  size_t num_events() const { return targets.size(); }
+
+  CachedViewpoint compute(const Pred &lt_vp, const Pred &st_proto) const {
+    CachedViewpoint result;
+    result.name = lt_vp.vp_name();
+    result.long_term.resize(num_events());
+    result.short_term.resize(num_events());
+
+    std::unique_ptr<Pred> st_vp(st_proto.clone());
+    auto lt_cursor = lt_vp.make_cursor();
+    auto st_cursor = st_vp->make_cursor();
+
+    size_t k = 0;
+    for (const auto &piece : corpus) {
+      st_vp->reset();
+      Features ctx;
+      for (const auto &e : piece) {
+        result.long_term.record(k, lt_vp.try_predict_at(ctx, lt_cursor.get()));
+        result.short_term.record(k, 
+            st_vp->try_predict_at(ctx, st_cursor.get()));
+        ctx.push_back(e);
+        st_vp->learn_from_tail(ctx);
+        k++;
+      }
+    }
+
+    return result;
+  }
+
+  CachedViewpoint compute_untrained(const Pred &vp, const corpus_t &train_corp,
+      unsigned int lt_history, unsigned int st_history) const {
+    std::unique_ptr<Pred> lt_vp(vp.clone());
+    lt_vp->set_history(lt_history);
+    for (const auto &piece : train_corp)
+      lt_vp->learn(Features(piece));
+
+    std::unique_ptr<Pred> st_vp(vp.clone());
+    st_vp->set_history(st_history);
+
+    return compute(*lt_vp, *st_vp);
+  }
+
+  // the distribution predicted at event k by a layer consisting of the given
+  // viewpoints (see ChoraleVPLayer::try_predict). returns false if none of
+  // the viewpoints could predict.
+  bool layer_values(const std::vector<size_t> &system,
+                    Column CachedViewpoint::*layer,
+                    double bias, size_t k, values_t &result) const {
+    const size_t row = k * T::cardinality;
+
+    if (system.size() == 1) {
+      const auto &col = viewpoints[system.front()].*layer;
+      if (!col.valid[k])
+        return false;
+
+      std::copy(col.values.begin() + row,
+                col.values.begin() + row + T::cardinality, result.begin());
+      return true;
+    }
+
+    // as in LogGeoEntropyCombination
+    result.fill(0.0);
+    double sum_of_weights = 0.0;
+    bool any_valid = false;
+    for (auto i : system) {
+      const auto &col = viewpoints[i].*layer;
+      if (!col.valid[k])
+        continue;
+
+      any_valid = true;
+      double weight = std::pow(col.norm_entropy[k], -bias);
+      sum_of_weights += weight;
+      for (unsigned int e = 0; e < T::cardinality; e++)
+        result[e] += weight * col.log_values[row + e];
+    }
+
+    if (!any_valid)
+      return false;
+
+    double total_probability = 0.0;
+    for (auto &v : result) {
+      v = std::pow(2.0, v / sum_of_weights);
+      total_probability += v;
+    }
+
+    for (auto &v : result)
+      v /= total_probability;
+
+    return true;
+  }
+
+public:
+  explicit PredictionCache(const corpus_t &test_corpus) : corpus(test_corpus) {
+    for (const auto &piece : corpus) {
+      piece_offsets.push_back(targets.size());
+      for (const auto &e : piece)
+        targets.push_back(e.template project<T>().encode());
+    }
+  }
+
+  size_t size() const { return viewpoints.size(); }
+
+  // indices of all of the cached viewpoints, i.e. the system made of all of them
+  std::vector<size_t> all_viewpoints() const {
+    std::vector<size_t> result(viewpoints.size());
+    for (size_t i = 0; i < result.size(); i++)
+      result[i] = i;
+    return result;
+  }
+
+  const std::string &vp_name(size_t i) const { return viewpoints.at(i).name; }
+
+  // caches the predictions of viewpoints whose long-term models have already
+  // been trained, in parallel. st_protos[i] is the short-term counterpart of
+  // lt_vps[i]: it is cloned, and reset before each piece. returns the index of
+  // the first viewpoint added (the rest follow on in order).
+  size_t add_trained(const std::vector<const Pred *> &lt_vps,
+                     const std::vector<const Pred *> &st_protos,
+                     ThreadPool &pool) {
+    assert(lt_vps.size() == st_protos.size());
+    const size_t first = viewpoints.size();
+    viewpoints.resize(first + lt_vps.size());
+    pool.parallel_for(lt_vps.size(), [&](size_t i) {
+      viewpoints[first + i] = compute(*lt_vps[i], *st_protos[i]);
+    });
+    return first;
+  }
+
+  // trains a long-term model for each of the (untrained) viewpoints on the
+  // training corpus, and caches the predictions of each of them. the
+  // viewpoints are processed in parallel. returns the index of the first
+  // viewpoint added (the rest follow on in order).
+  size_t add_untrained(const std::vector<const Pred *> &vps,
+                       const corpus_t &train_corp,
+                       unsigned int lt_history, unsigned int st_history,
+                       ThreadPool &pool) {
+    const size_t first = viewpoints.size();
+    viewpoints.resize(first + vps.size());
+    pool.parallel_for(vps.size(), [&](size_t i) {
+      viewpoints[first + i] =
+        compute_untrained(*vps[i], train_corp, lt_history, st_history);
+    });
+    return first;
+  }
+
+  // the average (per-piece) cross-entropy of the test corpus under a system
+  // whose layers consist of the given cached viewpoints. this is equal to
+  // evaluating such a system directly.
+  double cross_entropy(const std::vector<size_t> &system,
+                       double intra_bias, double inter_bias,
+                       bool enable_short_term) const {
+    assert(!system.empty());
+    LogGeoEntropyCombination<T> inter_comb(inter_bias);
+
+    values_t lt_values, st_values;
+    double corpus_total = 0.0;
+
+    for (size_t p = 0; p < corpus.size(); p++) {
+      const size_t begin = piece_offsets[p];
+      const size_t end = begin + corpus[p].size();
+
+      double total_entropy = 0.0;
+      for (size_t k = begin; k < end; k++) {
+        if (!layer_values(system, &CachedViewpoint::long_term,
+                          intra_bias, k, lt_values))
+          throw ViewpointPredictionException("No viewpoints can predict context");
+
+        double prob;
+        if (enable_short_term) {
+          if (!layer_values(system, &CachedViewpoint::short_term,
+                            intra_bias, k, st_values))
+            throw ViewpointPredictionException(
+                "No viewpoints can predict context");
+
+          auto combined = inter_comb.combine({
+            EventDistribution<T>(st_values), EventDistribution<T>(lt_values)
+          });
+          prob = combined[targets[k]];
+        }
+        else
+          prob = lt_values[targets[k]];
+
+        total_entropy -= std::log2(prob);
+      }
+
+      corpus_total += total_entropy / corpus[p].size();
+    }
+
+    return corpus_total / corpus.size();
+  }
+};
+
+#endif
@@ -19,6 +19,11 @@ public:
   static DefaultRandomSource shared_source;
 
   DefaultRandomSource();
+
+  // draws from the given engine's stream rather than a random seed
+  explicit DefaultRandomSource(const xoroshiro128plus_engine &e) :
+    engine(e), distribution{0.0, 1.0} {}
+
   double sample() override { return distribution(engine); }
 };
 
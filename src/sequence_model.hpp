@@ -1,15 +1,18 @@
 #ifndef AJC_HGUARD_SEQMODEL
 #define AJC_HGUARD_SEQMODEL
 
+#include <algorithm>
 #include <cassert>
 #include <numeric> // gives us e.g. std::accumulate
 #include <array>
+#include <bitset>
 #include <cmath>
 
 #include "event.hpp"
 #include "event_enumerator.hpp"
 #include "context_model.hpp"
 #include "random_source.hpp"
+#include "successor_cache.hpp"
 
 // accuracy to which distributions must sum to 1
 #define DISTRIBUTION_EPS 1e-13
@@ -17,6 +20,10 @@
 // forward declaration
 template<class T> class EventDistribution;
 
+// a set of events of type T, indexed by code
+template<class T>
+using EventMask = std::bitset<T::cardinality>;
+
 /* SequenceModel provides an abstraction of the ContextModel class, such that
  * the model takes abstract events and encodes them for appropriately for the
  * underlying ContextModel */
@@ -167,6 +174,7 @@ private:
   std::array<double, T::cardinality> values;
 
 public:
+  EventDistribution(); // uniform distribution
   EventDistribution(const std::array<double, T::cardinality> &vs);
   EventDistribution(const DistCombStrategy<T> &strategy, 
       const std::vector<EventDistribution> &dist);
@@ -174,10 +182,31 @@ public:
   EventDistribution<T> weighted_combination (
       const std::vector<EventDistribution<T> &> &vector);
   double probability_for(const T &event) const;
+  double probability_for_code(unsigned int code) const { return values[code]; }
   double entropy() const;
   double normalised_entropy() const;
   T sample() const;
   T sample_with_source(RandomSource *) const;
+
+  // draws n samples, writing them to out. this builds an alias table (see
+  // AliasSampler) first, so is cheaper than sampling repeatedly for large n.
+  template<class OutputIt>
+  void sample_n(size_t n, OutputIt out, RandomSource *rs) const;
+
+  // the n most probable events (all of them if n >= T::cardinality), most
+  // probable first. ties go to the event with the lower code.
+  std::vector<T> most_probable(size_t n) const;
+
+  // the distribution truncated to the k most probable events (top-k), or to
+  // the fewest most probable events with total probability at least p (top-p
+  // or nucleus), and renormalised. k = 0 and p >= 1 leave it as it is.
+  EventDistribution<T> top_k(unsigned int k) const;
+  EventDistribution<T> top_p(double p) const;
+
+  // the distribution conditioned on the event being in the mask, which must
+  // have some probability
+  EventDistribution<T> masked(const EventMask<T> &allowed) const;
+
   void combine_in_place(const DistCombStrategy<T> &strategy, 
       const EventDistribution<T> &dist) {
     EventDistribution combined(strategy, {dist,*this});
@@ -186,6 +215,29 @@ public:
   std::string debug_summary() const;
 };
 
+/* Prediction<T>
+ *
+ * The result of asking a viewpoint for a distribution over T. Not every
+ * viewpoint can predict in every context (e.g. seqint needs a previous pitch),
+ * in which case the prediction is empty. This lets callers which expect this
+ * (like the intra-layer combination) skip such viewpoints without throwing. */
+template<class T> class Prediction {
+private:
+  bool valid;
+  EventDistribution<T> dist;
+
+public:
+  Prediction() : valid(false) {}
+  Prediction(const EventDistribution<T> &d) : valid(true), dist(d) {}
+
+  explicit operator bool() const { return valid; }
+  const EventDistribution<T> &operator*() const { 
+    assert(valid);
+    return dist; 
+  }
+  const EventDistribution<T> *operator->() const { return &(**this); }
+};
+
 /**************************************************
  * EventDistribution: public methods
  **************************************************/
@@ -201,6 +253,11 @@ EventDistribution<T>::debug_summary() const {
   return result;
 }
 
+template<class T>
+EventDistribution<T>::EventDistribution() {
+  values.fill(1.0 / (double)T::cardinality);
+}
+
 template<class T> 
 EventDistribution<T>::EventDistribution(
     const std::array<double, T::cardinality> &vs) : values(vs) {
@@ -263,31 +320,26 @@ double EventDistribution<T>::normalised_entropy() const {
 
 template<class T>
 T EventDistribution<T>::sample_with_source(RandomSource *rs) const {
-  // build a cumulative frequency distribution and sample from that
-  std::array<double, T::cardinality> cfd{{0.0}};
-  double total_probability = 0.0;
+  // for a single sample, it's cheapest to walk along the cumulative
+  // distribution until we pass the target, i.e. find the first i with
+  //   p <= values[0] + ... + values[i]
+  // skipping events with zero probability (e.g. masked out), which must never
+  // be drawn. if rounding leaves the total just short of p, we take the last
+  // event with some probability.
+  double target_probability = rs->sample();
+  double cumulative = 0.0;
+  unsigned int chosen = 0;
   for (unsigned int i = 0; i < T::cardinality; i++) {
-    total_probability += values[i];
-    cfd[i] = total_probability;
-  }
+    if (values[i] == 0.0)
+      continue;
 
-  double target_probability = rs->sample();
-    
-  // binary search to find i s.t.
-  // cfd[i-1] < p <= cfd[i]
-  // or 0 <= p <= cfd[1] if p <= cfd[1]
-  unsigned int ub = T::cardinality; // exclusive
-  unsigned int lb = 0; // inclusive
-
-  while (ub - lb > 1) {
-    unsigned int midpoint = (ub + lb)/2;
-    if (target_probability <= cfd[midpoint - 1])
-      ub = midpoint;
-    else 
-      lb = midpoint;
+    chosen = i;
+    cumulative += values[i];
+    if (target_probability <= cumulative)
+      break;
   }
 
-  return T(lb);
+  return T(chosen);
 }
 
 template<class T>
@@ -295,6 +347,145 @@ T EventDistribution<T>::sample() const {
   return sample_with_source(&DefaultRandomSource::shared_source);
 }
 
+template<class T>
+std::vector<T> EventDistribution<T>::most_probable(size_t n) const {
+  std::vector<unsigned int> codes(T::cardinality);
+  std::iota(codes.begin(), codes.end(), 0);
+
+  n = std::min<size_t>(n, T::cardinality);
+  std::partial_sort(codes.begin(), codes.begin() + n, codes.end(),
+    [this](unsigned int a, unsigned int b) {
+      return values[a] > values[b] || (values[a] == values[b] && a < b);
+    });
+
+  std::vector<T> result;
+  for (size_t i = 0; i < n; i++)
+    result.push_back(T(codes[i]));
+  return result;
+}
+
+template<class T>
+EventDistribution<T>
+EventDistribution<T>::masked(const EventMask<T> &allowed) const {
+  std::array<double, T::cardinality> kept{{0.0}};
+  double total_probability = 0.0;
+  for (unsigned int i = 0; i < T::cardinality; i++) {
+    if (allowed[i]) {
+      kept[i] = values[i];
+      total_probability += values[i];
+    }
+  }
+
+  assert(total_probability > 0.0);
+  for (auto &v : kept)
+    v /= total_probability;
+
+  return EventDistribution<T>(kept);
+}
+
+template<class T>
+EventDistribution<T> EventDistribution<T>::top_k(unsigned int k) const {
+  if (k == 0 || k >= (unsigned int)T::cardinality)
+    return *this;
+
+  EventMask<T> top;
+  for (const auto &e : most_probable(k))
+    top.set(e.encode());
+  return masked(top);
+}
+
+template<class T>
+EventDistribution<T> EventDistribution<T>::top_p(double p) const {
+  if (p >= 1.0)
+    return *this;
+
+  EventMask<T> nucleus;
+  double cumulative = 0.0;
+  for (const auto &e : most_probable(T::cardinality)) {
+    nucleus.set(e.encode());
+    cumulative += values[e.encode()];
+    if (cumulative >= p)
+      break;
+  }
+
+  return masked(nucleus);
+}
+
+/* AliasSampler<T>
+ *
+ * Samples from a fixed distribution in O(1) time per sample with Walker's
+ * alias method, using Vose's O(n) construction of the table. Each event code i
+ * gets a column of equal width, which is split between i itself (with
+ * probability threshold[i]) and one other event, alias[i]. A sample picks a
+ * column and a point within it from a single uniform variate.
+ *
+ * Building the table costs about as much as a few samples with
+ * EventDistribution::sample_with_source, so this is for distributions which
+ * are sampled many times. */
+template<class T> class AliasSampler {
+  std::array<double, T::cardinality> threshold;
+  std::array<unsigned int, T::cardinality> alias;
+
+  unsigned int sample_code(RandomSource *rs) const {
+    double x = rs->sample() * T::cardinality;
+    unsigned int column = std::min<unsigned int>(x, T::cardinality - 1);
+    return (x - column < threshold[column]) ? column : alias[column];
+  }
+
+public:
+  explicit AliasSampler(const EventDistribution<T> &dist);
+
+  T sample_with_source(RandomSource *rs) const { return T(sample_code(rs)); }
+  T sample() const { 
+    return sample_with_source(&DefaultRandomSource::shared_source);
+  }
+
+  template<class OutputIt>
+  void sample_n(size_t n, OutputIt out, RandomSource *rs) const {
+    for (size_t i = 0; i < n; i++)
+      *out++ = T(sample_code(rs));
+  }
+};
+
+template<class T>
+AliasSampler<T>::AliasSampler(const EventDistribution<T> &dist) {
+  // scale the probabilities so that the average column is full (1.0), then
+  // repeatedly top up an under-full column from an over-full one
+  std::array<double, T::cardinality> scaled;
+  std::vector<unsigned int> small, large;
+  for (unsigned int i = 0; i < T::cardinality; i++) {
+    scaled[i] = dist.probability_for_code(i) * T::cardinality;
+    alias[i] = i;
+    (scaled[i] < 1.0 ? small : large).push_back(i);
+  }
+
+  while (!small.empty() && !large.empty()) {
+    unsigned int s = small.back(); 
+    small.pop_back();
+    unsigned int l = large.back();
+
+    threshold[s] = scaled[s];
+    alias[s] = l;
+    scaled[l] -= 1.0 - scaled[s];
+    if (scaled[l] < 1.0) {
+      large.pop_back();
+      small.push_back(l);
+    }
+  }
+
+  // whatever is left is full, up to rounding error
+  for (auto i : large)
+    threshold[i] = 1.0;
+  for (auto i : small)
+    threshold[i] = 1.0;
+}
+
+template<class T> template<class OutputIt>
+void EventDistribution<T>::sample_n(size_t n, OutputIt out, 
+                                    RandomSource *rs) const {
+  AliasSampler<T>(*this).sample_n(n, out, rs);
+}
+
 /**************************************************
  * SequenceModel: declaration
  **************************************************/
@@ -303,11 +494,21 @@ template<class T> class SequenceModel {
 private:
   ContextModel<T::cardinality> model; // underlying context model
 
+  // optional (disabled by default), see set_cache_capacity
+  mutable SuccessorCache cache;
+
+  // the cache has to be emptied whenever the model changes
+  void model_changed() {
+    if (cache.enabled())
+      cache.clear();
+  }
+
   std::vector<unsigned int> encode_sequence(const std::vector<T> &seq) const;
 
 public:
   SequenceModel(unsigned int history);
   void learn_sequence(const std::vector<T> &seq);
+  void unlearn_sequence(const std::vector<T> &seq);
   void clear_model();
   void set_history(unsigned int h);
   unsigned int get_history() const;
@@ -316,6 +517,52 @@ public:
   double avg_sequence_entropy(const std::vector<T> &seq) const;
   unsigned int count_of(const std::vector<T> &seq) const;
   EventDistribution<T> gen_successor_dist(const std::vector<T> &ctx) const;
+
+  // versions of the above which take sequences that have already been encoded
+  // (e.g. columns of a feature cache), avoiding the construction of events
+  void learn_encoded(const std::vector<unsigned int> &seq);
+  void unlearn_encoded(const std::vector<unsigned int> &seq);
+  void update_from_encoded_tail(const std::vector<unsigned int> &seq);
+  EventDistribution<T> 
+    gen_successor_dist_encoded(const std::vector<unsigned int> &ctx) const;
+
+  // raw successor probabilities indexed by event code. this skips
+  // constructing (and validating) an EventDistribution, which is useful when
+  // the caller is only going to marginalise the result anyway.
+  std::array<double, T::cardinality>
+    gen_successor_values(const std::vector<unsigned int> &ctx) const;
+
+  // the same successor probabilities in sparse form: only events seen along
+  // the chain of escapes are listed, the rest share the escape mass
+  void gen_successors(const std::vector<unsigned int> &ctx,
+                      SparseSuccessors &result) const;
+
+  // cursors follow a context through the model as it grows, so that each
+  // prediction along a sequence doesn't have to match the context from scratch
+  // (see ContextModel::Cursor)
+  using Cursor = typename ContextModel<T::cardinality>::Cursor;
+  Cursor cursor() const { return Cursor(model); }
+  void gen_successors(const Cursor &cursor, SparseSuccessors &result) const;
+
+  // keeps up to `capacity` successor distributions, keyed by context, so that
+  // contexts which come up again don't have to be matched and escaped through
+  // again (see SuccessorCache). this is only worthwhile for models which don't
+  // change while predicting, e.g. long-term models. 0 disables the cache.
+  void set_cache_capacity(size_t capacity) { cache.set_capacity(capacity); }
+  SuccessorCacheStats cache_stats() const { return cache.get_stats(); }
+
+  // marks to roll learning back to (see ContextModel::checkpoint)
+  size_t checkpoint() { return model.checkpoint(); }
+  void rollback(size_t mark) {
+    model_changed();
+    model.rollback(mark);
+  }
+  void release_checkpoints() { model.release_checkpoints(); }
+
+  // the probabilities of the sparse distribution, indexed by event code
+  static std::array<double, T::cardinality>
+    expand_successors(const SparseSuccessors &succ);
+
   void write_latex(std::string filename) const;
 
   // we pass the location of this function to the underlying context model in
@@ -328,7 +575,7 @@ public:
  **************************************************/
 
 template<class T> 
-SequenceModel<T>::SequenceModel(unsigned int h) : model(h) {
+SequenceModel<T>::SequenceModel(unsigned int h) : model(h), cache(0) {
   // enforce T : SequenceEvent
   static_assert(std::is_base_of<SequenceEvent, T>::value, "SequenceModel can\
  only be specialized on SequenceEvents");
@@ -339,6 +586,7 @@ SequenceModel<T>::SequenceModel(unsigned int h) : model(h) {
 // simple wrappers around the context model
 template<class T>
 void SequenceModel<T>::set_history(unsigned int h) {
+  model_changed();
   model.set_history(h);
 }
 
@@ -349,16 +597,25 @@ unsigned int SequenceModel<T>::get_history() const {
 
 template<class T> 
 void SequenceModel<T>::learn_sequence(const std::vector<T> &seq) {
+  model_changed();
   model.learn_sequence(encode_sequence(seq));
 }
 
+template<class T> 
+void SequenceModel<T>::unlearn_sequence(const std::vector<T> &seq) {
+  model_changed();
+  model.unlearn_sequence(encode_sequence(seq));
+}
+
 template<class T>
 void SequenceModel<T>::clear_model() {
+  model_changed();
   model.clear_model();
 }
 
 template<class T>
 void SequenceModel<T>::update_from_tail(const std::vector<T> &seq) {
+  model_changed();
   model.update_from_tail(encode_sequence(seq));
 }
 
@@ -379,16 +636,76 @@ unsigned int SequenceModel<T>::count_of(const std::vector<T> &seq) const {
 
 template<class T> EventDistribution<T> 
 SequenceModel<T>::gen_successor_dist(const std::vector<T> &context) const {
-  std::vector<T> tmp_ctx(context);
+  return gen_successor_dist_encoded(encode_sequence(context));
+}
+
+template<class T>
+void SequenceModel<T>::learn_encoded(const std::vector<unsigned int> &seq) {
+  model_changed();
+  model.learn_sequence(seq);
+}
+
+template<class T>
+void SequenceModel<T>::unlearn_encoded(const std::vector<unsigned int> &seq) {
+  model_changed();
+  model.unlearn_sequence(seq);
+}
+
+template<class T> void
+SequenceModel<T>::update_from_encoded_tail(const std::vector<unsigned int> &seq) {
+  model_changed();
+  model.update_from_tail(seq);
+}
+
+template<class T> EventDistribution<T> SequenceModel<T>::
+gen_successor_dist_encoded(const std::vector<unsigned int> &context) const {
+  return EventDistribution<T>(gen_successor_values(context));
+}
+
+template<class T> std::array<double, T::cardinality> SequenceModel<T>::
+gen_successor_values(const std::vector<unsigned int> &context) const {
+  SparseSuccessors succ;
+  gen_successors(context, succ);
+  return expand_successors(succ);
+}
+
+template<class T> std::array<double, T::cardinality> SequenceModel<T>::
+expand_successors(const SparseSuccessors &succ) {
   std::array<double, T::cardinality> values;
+  values.fill(succ.unseen);
+  for (const auto &kv : succ.seen)
+    values[kv.first] = kv.second;
 
-  for (auto candidate_event : EventEnumerator<T>()) {
-    tmp_ctx.push_back(candidate_event);
-    values[candidate_event.encode()] = probability_of(tmp_ctx);
-    tmp_ctx.pop_back();
+  return values;
+}
+
+template<class T> void SequenceModel<T>::
+gen_successors(const std::vector<unsigned int> &context,
+               SparseSuccessors &result) const {
+  if (!cache.enabled()) {
+    model.successors(context, result);
+    return;
   }
 
-  return EventDistribution<T>(values);
+  // only the last (h-1) events of the context matter
+  auto h = model.get_history();
+  auto len = std::min(context.size(), (size_t)((h > 0) ? h - 1 : 0));
+  std::vector<unsigned int> key(context.end() - len, context.end());
+  if (cache.lookup(key, result))
+    return;
+
+  model.successors(context, result);
+  cache.insert(key, result);
+}
+
+template<class T> void SequenceModel<T>::
+gen_successors(const Cursor &cursor, SparseSuccessors &result) const {
+  if (cache.enabled() && cache.lookup(cursor.context(), result))
+    return;
+
+  model.successors(cursor, result);
+  if (cache.enabled())
+    cache.insert(cursor.context(), result);
 }
 
 template<class T>
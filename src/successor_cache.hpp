@@ -0,0 +1,161 @@
+#ifndef AJC_HGUARD_SUCCESSOR_CACHE
+#define AJC_HGUARD_SUCCESSOR_CACHE
+
+#include "context_model.hpp"
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+struct SuccessorCacheStats {
+  unsigned long hits;
+  unsigned long misses;
+};
+
+/* SuccessorCache
+ *
+ * A bounded cache of successor distributions (see ContextModel::successors),
+ * keyed by the encoded context that prediction looks at, i.e. the last (h-1)
+ * events. Once the cache is full, the least recently used entry is evicted.
+ *
+ * This pays off for models which are queried with the same short contexts over
+ * and over (e.g. the openings of pieces or common cadences) but don't change,
+ * such as a trained long-term model. Such a model may be shared by several
+ * evaluation threads, so a large cache is split by key hash into shards, each
+ * with its own mutex and its own share of the capacity (and LRU order). Only
+ * the lookup itself happens under the lock: distributions are shared
+ * immutably, and copied out after unlocking. The owner must clear the cache
+ * whenever the model changes.
+ *
+ * A capacity of zero disables the cache. Setting the capacity empties the
+ * cache, and mustn't happen while it is in use. Copying a cache gives an empty
+ * cache with the same capacity (the copy belongs to a different model). */
+class SuccessorCache {
+  using Key = std::vector<unsigned int>;
+  using Value = std::shared_ptr<const SparseSuccessors>;
+  using Entry = std::pair<Key, Value>;
+
+  struct KeyHash {
+    size_t operator()(const Key &key) const {
+      size_t h = key.size();
+      for (auto code : key)
+        h = h * 31 + code;
+      return h;
+    }
+  };
+
+  struct Shard {
+    size_t capacity;
+    std::list<Entry> entries; // most recently used first
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+    SuccessorCacheStats stats;
+    std::mutex mutex;
+
+    explicit Shard(size_t cap) : capacity(cap), stats{0, 0} {}
+  };
+
+  size_t capacity;
+  std::vector<std::unique_ptr<Shard>> shards;
+
+  Shard &shard_for(const Key &ctx) {
+    return *shards[KeyHash()(ctx) % shards.size()];
+  }
+
+public:
+  explicit SuccessorCache(size_t cap) : capacity(0) { set_capacity(cap); }
+  SuccessorCache(const SuccessorCache &other) : capacity(0) {
+    set_capacity(other.capacity);
+  }
+
+  SuccessorCache &operator=(const SuccessorCache &other) {
+    set_capacity(other.capacity);
+    return *this;
+  }
+
+  bool enabled() const { return capacity > 0; }
+
+  void set_capacity(size_t cap) {
+    // up to 16 shards, but none with fewer than 64 entries, so that small
+    // caches keep exact LRU order
+    const size_t num_shards = 
+      std::max<size_t>(1, std::min<size_t>(16, cap / 64));
+    capacity = cap;
+    shards.clear();
+    for (size_t i = 0; i < num_shards; i++) {
+      auto shard_cap = cap / num_shards + (i < cap % num_shards);
+      shards.emplace_back(new Shard(shard_cap));
+    }
+  }
+
+  // copies the cached successors of the context into result, if there are any
+  bool lookup(const Key &ctx, SparseSuccessors &result) {
+    auto &shard = shard_for(ctx);
+    Value found;
+    {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      auto it = shard.index.find(ctx);
+      if (it == shard.index.end()) {
+        shard.stats.misses++;
+        return false;
+      }
+
+      shard.stats.hits++;
+      shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+      found = it->second->second;
+    }
+
+    result.seen = found->seen;
+    result.unseen = found->unseen;
+    return true;
+  }
+
+  void insert(const Key &ctx, const SparseSuccessors &succ) {
+    auto &shard = shard_for(ctx);
+    if (shard.capacity == 0)
+      return;
+
+    Value value = std::make_shared<const SparseSuccessors>(succ);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.index.count(ctx) > 0)
+      return; // (another thread may have got there first)
+
+    if (shard.entries.size() == shard.capacity) {
+      shard.index.erase(shard.entries.back().first);
+      shard.entries.pop_back();
+    }
+
+    shard.entries.emplace_front(ctx, std::move(value));
+    shard.index[ctx] = shard.entries.begin();
+  }
+
+  void clear() {
+    for (auto &shard : shards) {
+      std::lock_guard<std::mutex> lock(shard->mutex);
+      shard->entries.clear();
+      shard->index.clear();
+    }
+  }
+
+  size_t size() {
+    size_t total = 0;
+    for (auto &shard : shards) {
+      std::lock_guard<std::mutex> lock(shard->mutex);
+      total += shard->entries.size();
+    }
+    return total;
+  }
+
+  SuccessorCacheStats get_stats() {
+    SuccessorCacheStats total{0, 0};
+    for (auto &shard : shards) {
+      std::lock_guard<std::mutex> lock(shard->mutex);
+      total.hits += shard->stats.hits;
+      total.misses += shard->stats.misses;
+    }
+    return total;
+  }
+};
+
+#endif
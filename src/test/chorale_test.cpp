@@ -1,7 +1,13 @@
 #include "catch.hpp"
 #include "chorale.hpp"
 #include "viewpoint.hpp"
+#include "prediction_cache.hpp"
+#include "corpus.hpp"
 #include <array>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <sstream>
 
 struct ChoraleMocker {
   static const MidiPitch default_pitch;
@@ -142,6 +148,55 @@ ChoraleMocker::default_dur = QuantizedDuration(4);
 const QuantizedDuration
 ChoraleMocker::default_rest_dur = QuantizedDuration(0);
 
+// the config of the small MVS which the prediction and generation tests share
+// (see trained_test_mvs)
+MVSConfig test_mvs_config(const std::string &name) {
+  MVSConfig config;
+  config.enable_short_term = true;
+  config.lt_history = 3;
+  config.st_history = 2;
+  config.mvs_name = name;
+  return config;
+}
+
+// an MVS with pitch, seqint, duration and rest viewpoints, trained on two
+// short pieces
+ChoraleMVS trained_test_mvs(const MVSConfig &config) {
+  ChoraleMVS mvs(config);
+  ChoraleMVS::GenVP<ChoralePitch> pitch_vp(3);
+  ChoraleMVS::GenVP<ChoraleInterval> seqint_vp(3);
+  ChoraleMVS::GenVP<ChoraleDuration> duration_vp(3);
+  ChoraleMVS::GenVP<ChoraleRest> rest_vp(3);
+  mvs.add_viewpoint(&pitch_vp);
+  mvs.add_viewpoint(&seqint_vp);
+  mvs.add_viewpoint(&duration_vp);
+  mvs.add_viewpoint(&rest_vp);
+
+  mvs.learn(ChoraleMocker::mock_sequence(ChoraleMocker::box_pitches(
+    {60,62,64,65,67,65,64,62,60,67,64,60,62,60})));
+  mvs.learn(ChoraleMocker::mock_sequence(ChoraleMocker::box_pitches(
+    {67,65,64,62,60,62,64,62,60})));
+  return mvs;
+}
+
+ChoraleMVS trained_test_mvs(const std::string &name) {
+  return trained_test_mvs(test_mvs_config(name));
+}
+
+bool same_events(const std::vector<ChoraleEvent> &a,
+                 const std::vector<ChoraleEvent> &b) {
+  if (a.size() != b.size())
+    return false;
+  for (size_t i = 0; i < a.size(); i++) {
+    if (a[i].pitch.encode() != b[i].pitch.encode() ||
+        a[i].duration.encode() != b[i].duration.encode() ||
+        a[i].rest.encode() != b[i].rest.encode() ||
+        a[i].keysig.encode() != b[i].keysig.encode())
+      return false;
+  }
+  return true;
+}
+
 
 TEST_CASE("Check Chorale event encodings", "[chorale][events]") {
   SECTION("Check interval encoding") {
@@ -240,6 +295,483 @@ TEST_CASE("Check predictions/entropy calculations in MVS") {
   }
 }
 
+TEST_CASE("Check MVS predicts all basic types at once") {
+  auto config = test_mvs_config("test MVS (all types)");
+  config.intra_layer_bias = 1.0;
+  config.inter_layer_bias = 2.0;
+  auto mvs = trained_test_mvs(config);
+
+  auto test = ChoraleMocker::mock_sequence(ChoraleMocker::box_pitches(
+    {62,64,65,64,62,60,67,69}));
+
+  auto all = mvs.avg_sequence_entropy_all(test);
+  REQUIRE( all.pitch == mvs.avg_sequence_entropy<ChoralePitch>(test) );
+  REQUIRE( all.duration == mvs.avg_sequence_entropy<ChoraleDuration>(test) );
+  REQUIRE( all.rest == mvs.avg_sequence_entropy<ChoraleRest>(test) );
+
+  SECTION("Evaluating a corpus in parallel gives the same entropies") {
+    std::vector<std::vector<ChoraleEvent>> corpus;
+    for (unsigned int i = 0; i < 9; i++) {
+      std::vector<unsigned int> pitches;
+      for (unsigned int j = 0; j < 5 + i; j++)
+        pitches.push_back(60 + (i * 3 + j * 5) % 9);
+      corpus.push_back(
+          ChoraleMocker::mock_sequence(ChoraleMocker::box_pitches(pitches)));
+    }
+
+    ThreadPool pool(3);
+    auto parallel = mvs.corpus_entropies(corpus, pool);
+    REQUIRE( parallel.size() == corpus.size() );
+
+    for (unsigned int i = 0; i < corpus.size(); i++) {
+      auto serial = mvs.avg_sequence_entropy_all(corpus[i]);
+      REQUIRE( parallel[i].pitch == serial.pitch );
+      REQUIRE( parallel[i].duration == serial.duration );
+      REQUIRE( parallel[i].rest == serial.rest );
+    }
+  }
+}
+
+TEST_CASE("Check MVS sessions predict incrementally") {
+  auto config = test_mvs_config("test MVS (sessions)");
+  config.intra_layer_bias = 1.0;
+  config.inter_layer_bias = 2.0;
+  auto mvs = trained_test_mvs(config);
+
+  auto test = ChoraleMocker::mock_sequence(ChoraleMocker::box_pitches(
+    {62,64,65,64,62,60,67,69,67,65}));
+
+  // accumulating the session's predictions gives the MVS's own entropies
+  auto session_entropies = [&test](ChoraleMVS::Session &session) {
+    ChoraleEntropies total{0.0, 0.0, 0.0};
+    for (const auto &e : test) {
+      auto dists = session.next_all();
+      REQUIRE( session.next<ChoralePitch>().probability_for(e.pitch) ==
+               dists.pitch.probability_for(e.pitch) );
+      total.pitch -= std::log2(dists.pitch.probability_for(e.pitch));
+      total.duration -= std::log2(dists.duration.probability_for(e.duration));
+      total.rest -= std::log2(dists.rest.probability_for(e.rest));
+      session.push(e);
+    }
+    return ChoraleEntropies { total.pitch / test.size(), 
+      total.duration / test.size(), total.rest / test.size() };
+  };
+
+  ChoraleMVS::Session session(mvs);
+  auto actual = session_entropies(session);
+  REQUIRE( session.size() == test.size() );
+
+  auto expected = mvs.avg_sequence_entropy_all(test);
+  REQUIRE( actual.pitch == expected.pitch );
+  REQUIRE( actual.duration == expected.duration );
+  REQUIRE( actual.rest == expected.rest );
+
+  SECTION("Resetting a session starts a fresh piece") {
+    session.reset();
+    REQUIRE( session.size() == 0 );
+    auto again = session_entropies(session);
+    REQUIRE( again.pitch == expected.pitch );
+    REQUIRE( again.rest == expected.rest );
+  }
+
+  SECTION("Rolling a session back to a checkpoint") {
+    session.reset();
+    for (size_t i = 0; i < 4; i++)
+      session.push(test[i]);
+    auto cp = session.checkpoint();
+
+    // try out a different continuation, then take it back
+    auto other = ChoraleMocker::mock_sequence(ChoraleMocker::box_pitches(
+      {60,67,65,64,60}));
+    for (const auto &e : other)
+      session.push(e);
+    session.rollback(cp);
+    REQUIRE( session.size() == 4 );
+
+    // the session carries on as if the other continuation never happened
+    ChoraleMVS::Session control(mvs);
+    for (size_t i = 0; i < 4; i++)
+      control.push(test[i]);
+    for (size_t i = 4; i < test.size(); i++) {
+      auto expected_dists = control.next_all();
+      auto actual_dists = session.next_all();
+      for (unsigned int c = 0; c < ChoralePitch::cardinality; c++)
+        REQUIRE( actual_dists.pitch.probability_for_code(c) ==
+                 expected_dists.pitch.probability_for_code(c) );
+      for (unsigned int c = 0; c < ChoraleDuration::cardinality; c++)
+        REQUIRE( actual_dists.duration.probability_for_code(c) ==
+                 expected_dists.duration.probability_for_code(c) );
+      control.push(test[i]);
+      session.push(test[i]);
+    }
+  }
+}
+
+TEST_CASE("Check sampling pieces in parallel") {
+  auto mvs = trained_test_mvs("test MVS (generation)");
+
+  xoroshiro128plus_engine engine;
+  engine.seed({{ 314, 42, 2718, 99 }});
+  auto high_pitch_entropy = [](const ChoraleEntropies &h) { 
+    return h.pitch > 1.0; 
+  };
+
+  ThreadPool no_helpers(0);
+  ThreadPool helpers(3);
+  auto serial = mvs.sample_pieces(6, 12, QuantizedDuration(16), 
+                                  high_pitch_entropy, 1000, engine, no_helpers);
+  auto parallel = mvs.sample_pieces(6, 12, QuantizedDuration(16), 
+                                    high_pitch_entropy, 1000, engine, helpers);
+
+  REQUIRE( serial.size() == 6 );
+  for (size_t i = 0; i < serial.size(); i++) {
+    REQUIRE( same_events(serial[i].events, parallel[i].events) );
+    REQUIRE( serial[i].attempts == parallel[i].attempts );
+    REQUIRE( serial[i].attempts >= 1 );
+    REQUIRE( serial[i].accepted );
+    REQUIRE( serial[i].events.size() == 12 );
+    REQUIRE( serial[i].entropies.pitch > 1.0 );
+
+    // the entropies worked out while sampling are the MVS's own
+    auto expected = mvs.avg_sequence_entropy_all(serial[i].events);
+    REQUIRE( serial[i].entropies.pitch == expected.pitch );
+    REQUIRE( serial[i].entropies.duration == expected.duration );
+    REQUIRE( serial[i].entropies.rest == expected.rest );
+  }
+
+  // different pieces come from different streams
+  REQUIRE_FALSE( same_events(serial[0].events, serial[1].events) );
+
+  SECTION("A batch gives up on pieces it can't accept") {
+    auto rejected = mvs.sample_pieces(3, 12, QuantizedDuration(16),
+      [](const ChoraleEntropies &) { return false; }, 5, engine, helpers);
+    REQUIRE( rejected.size() == 3 );
+    for (const auto &piece : rejected) {
+      REQUIRE_FALSE( piece.accepted );
+      REQUIRE( piece.attempts == 5 );
+      REQUIRE( piece.events.size() == 12 );
+    }
+  }
+}
+
+TEST_CASE("Check beam search and top-k decoding") {
+  auto mvs = trained_test_mvs("test MVS (decoding)");
+
+  auto total = [](const GeneratedChorale &piece) {
+    const auto &h = piece.entropies;
+    return (h.pitch + h.duration + h.rest) * piece.events.size();
+  };
+
+  const unsigned int len = 10;
+  const QuantizedDuration timesig(16);
+
+  // sampling from only the most probable event is greedy decoding
+  xoroshiro128plus_engine engine;
+  engine.seed({{ 1, 2, 3, 4 }});
+  DefaultRandomSource rs(engine);
+  SamplingConfig greedy_config;
+  greedy_config.top_k = 1;
+  ChoraleMVS::Session session(mvs);
+  auto greedy = mvs.sample_piece(session, len, timesig, &rs, greedy_config);
+  auto keysig = greedy.events.front().keysig;
+
+  SECTION("Greedy decoding and beam width 1 agree") {
+    auto beam = mvs.beam_search(len, timesig, keysig, 1);
+    REQUIRE( beam.size() == 1 );
+    REQUIRE( same_events(beam.front().events, greedy.events) );
+  }
+
+  SECTION("Wider beams find pieces at least as likely") {
+    auto beam = mvs.beam_search(len, timesig, keysig, 4);
+    REQUIRE( beam.size() == 4 );
+    REQUIRE( total(beam.front()) <= total(greedy) + 1e-9 );
+
+    for (size_t i = 0; i < beam.size(); i++) {
+      REQUIRE( beam[i].events.size() == len );
+      if (i > 0) {
+        REQUIRE( total(beam[i-1]) <= total(beam[i]) );
+        REQUIRE_FALSE( same_events(beam[i-1].events, beam[i].events) );
+      }
+
+      // each piece's session learned exactly that piece
+      auto expected = mvs.avg_sequence_entropy_all(beam[i].events);
+      REQUIRE( beam[i].entropies.pitch == Approx(expected.pitch) );
+      REQUIRE( beam[i].entropies.duration == Approx(expected.duration) );
+      REQUIRE( beam[i].entropies.rest == Approx(expected.rest) );
+    }
+  }
+
+  SECTION("Nucleus sampling only picks from the nucleus") {
+    SamplingConfig nucleus_config;
+    nucleus_config.top_p = 0.5;
+    auto piece = mvs.sample_piece(session, len, timesig, &rs, nucleus_config);
+
+    ChoraleMVS::Session replay(mvs);
+    for (const auto &e : piece.events) {
+      auto dists = replay.next_all();
+      if (replay.size() > 0) {
+        auto nucleus = dists.pitch.top_p(0.5);
+        REQUIRE( nucleus.probability_for(e.pitch) > 0.0 );
+      }
+      REQUIRE( dists.duration.top_p(0.5).probability_for(e.duration) > 0.0 );
+      REQUIRE( dists.rest.top_p(0.5).probability_for(e.rest) > 0.0 );
+      replay.push(e);
+    }
+  }
+}
+
+TEST_CASE("Check constrained generation satisfies its constraints") {
+  auto mvs = trained_test_mvs("test MVS (constraints)");
+
+  // ten notes making up three bars of 4/4, within a sixth of middle C,
+  // ending on a long tonic
+  const unsigned int len = 10;
+  const QuantizedDuration timesig(16);
+  ChoraleKeySig keysig(KeySig(0));
+  GenerationConstraints constraints(len);
+  constraints.total_duration = 3 * 16;
+  auto in_range = GenerationConstraints::pitches_where([](unsigned int p) {
+    return 60 <= p && p <= 69;
+  });
+  for (auto &step : constraints.steps)
+    step.pitch = in_range;
+  constraints.steps.back().pitch = GenerationConstraints::pitches_where(
+    [](unsigned int p) { return p == 60; });
+  constraints.steps.back().duration.reset();
+  constraints.steps.back().duration.set(ChoraleDuration(QuantizedDuration(8))
+                                        .encode());
+
+  xoroshiro128plus_engine engine;
+  engine.seed({{ 27, 18, 28, 18 }});
+  ThreadPool pool(2);
+  auto pieces = mvs.sample_constrained_pieces(20, keysig, timesig, constraints,
+    [](const ChoraleEntropies &) { return true; }, 1000, engine, pool);
+
+  for (const auto &piece : pieces) {
+    // nothing has to be rejected
+    REQUIRE( piece.accepted );
+    REQUIRE( piece.attempts == 1 );
+    REQUIRE( piece.events.size() == len );
+
+    unsigned int total = 0;
+    for (const auto &e : piece.events) {
+      REQUIRE( e.pitch.raw_value() >= 60 );
+      REQUIRE( e.pitch.raw_value() <= 69 );
+      total += e.rest.raw_value() + e.duration.raw_value();
+    }
+    REQUIRE( total == 3 * 16 );
+    REQUIRE( piece.events.back().pitch.raw_value() == 60 );
+    REQUIRE( piece.events.back().duration.raw_value() == 8 );
+
+    // the entropies are still those of the unconstrained MVS
+    auto expected = mvs.avg_sequence_entropy_all(piece.events);
+    REQUIRE( piece.entropies.pitch == Approx(expected.pitch) );
+    REQUIRE( piece.entropies.duration == Approx(expected.duration) );
+    REQUIRE( piece.entropies.rest == Approx(expected.rest) );
+  }
+
+  SECTION("Constraints which can't be satisfied are refused") {
+    ChoraleMVS::Session session(mvs);
+    DefaultRandomSource rs(engine);
+
+    GenerationConstraints too_long(2);
+    too_long.total_duration = 1000;
+    REQUIRE_THROWS_AS( mvs.sample_constrained(session, keysig, timesig, 
+                                              too_long, &rs), 
+                       const ConstraintError & );
+
+    GenerationConstraints no_pitches(4);
+    no_pitches.steps[2].pitch.reset();
+    REQUIRE_THROWS_AS( mvs.sample_constrained(session, keysig, timesig, 
+                                              no_pitches, &rs),
+                       const ConstraintError & );
+  }
+}
+
+TEST_CASE("Check caching long-term predictions doesn't change them") {
+  auto control = trained_test_mvs("test MVS (control)");
+  auto cached = trained_test_mvs("test MVS (cached)");
+  cached.set_long_term_cache(64);
+
+  // the test piece repeats itself, so its second half should hit the cache
+  auto test = ChoraleMocker::mock_sequence(ChoraleMocker::box_pitches(
+    {62,64,65,64,62,60,62,64,65,64,62,60}));
+  auto expected = control.avg_sequence_entropy_all(test);
+  auto actual = cached.avg_sequence_entropy_all(test);
+  REQUIRE( actual.pitch == expected.pitch );
+  REQUIRE( actual.duration == expected.duration );
+  REQUIRE( actual.rest == expected.rest );
+
+  auto stats = cached.long_term_cache_stats();
+  REQUIRE( stats.hits > 0 );
+  REQUIRE( stats.misses > 0 );
+  REQUIRE( control.long_term_cache_stats().hits == 0 );
+}
+
+TEST_CASE("Check unlearning a piece from an MVS undoes learning it") {
+  MVSConfig config;
+  config.enable_short_term = true;
+  config.intra_layer_bias = 0.5;
+  config.inter_layer_bias = 1.0;
+  config.lt_history = 3;
+  config.st_history = 2;
+  config.mvs_name = "test MVS (unlearning)";
+
+  ChoraleMVS::GenVP<ChoralePitch> pitch_vp(3);
+  ChoraleMVS::GenVP<ChoraleInterval> seqint_vp(3);
+  ChoraleMVS::GenLinkedVP<ChoraleDuration, ChoralePitch> linked_vp(3);
+  ChoraleMVS::GenVP<ChoraleDuration> duration_vp(3);
+  ChoraleMVS::GenVP<ChoraleRest> rest_vp(3);
+
+  ChoraleMVS control(config);
+  ChoraleMVS test(config);
+  for (auto mvs : { &control, &test }) {
+    mvs->add_viewpoint(&pitch_vp);
+    mvs->add_viewpoint(&seqint_vp);
+    mvs->add_viewpoint(&linked_vp);
+    mvs->add_viewpoint(&duration_vp);
+    mvs->add_viewpoint(&rest_vp);
+  }
+
+  auto kept = ChoraleMocker::mock_sequence(ChoraleMocker::box_pitches(
+    {60,62,64,65,67,65,64,62,60,67,64,60,62,60}));
+  auto removed = ChoraleMocker::mock_sequence(ChoraleMocker::box_pitches(
+    {67,69,71,72,71,69,67,66,67}));
+
+  control.learn(kept);
+  test.learn(removed);
+  test.learn(kept);
+  test.unlearn(removed);
+
+  for (const auto &piece : { kept, removed }) {
+    auto expected = control.avg_sequence_entropy_all(piece);
+    auto actual = test.avg_sequence_entropy_all(piece);
+    REQUIRE( actual.pitch == expected.pitch );
+    REQUIRE( actual.duration == expected.duration );
+    REQUIRE( actual.rest == expected.rest );
+  }
+}
+
+TEST_CASE("Check parallel layer prediction agrees with sequential") {
+  ChoraleMVS::GenVP<ChoralePitch> pitch_vp(3);
+  ChoraleMVS::GenVP<ChoraleInterval> seqint_vp(3);
+  ChoraleMVS::GenVP<ChoraleIntref> intref_vp(3);
+  ChoraleMVS::GenLinkedVP<ChoraleDuration, ChoralePitch> linked_vp(3);
+
+  ChoraleVPLayer seq_layer(0.5, 3);
+  ChoraleVPLayer par_layer(0.5, 3);
+  for (auto layer : { &seq_layer, &par_layer }) {
+    layer->add_viewpoint(&pitch_vp);
+    layer->add_viewpoint(&seqint_vp);
+    layer->add_viewpoint(&intref_vp);
+    layer->add_viewpoint(&linked_vp);
+  }
+
+  auto train = ChoraleMocker::mock_sequence(ChoraleMocker::box_pitches(
+    {60,62,64,65,67,65,64,62,60,67,64,60,62,60}));
+  seq_layer.learn(train);
+  par_layer.learn(train);
+
+  ThreadPool pool(3);
+  par_layer.set_thread_pool(&pool, 2);
+
+  ChoraleFeatures ctx;
+  for (const auto &e : train) {
+    auto expected = seq_layer.predict<ChoralePitch>(ctx);
+    auto actual = par_layer.predict<ChoralePitch>(ctx);
+    for (auto p : EventEnumerator<ChoralePitch>())
+      REQUIRE( actual.probability_for(p) == expected.probability_for(p) );
+    ctx.push_back(e);
+  }
+}
+
+TEST_CASE("Check cached predictions recombine to the MVS cross-entropy") {
+  // a handful of small pieces that stay within the seqint domain
+  auto make_corpus = [](unsigned int seed, unsigned int n) {
+    std::vector<std::vector<ChoraleEvent>> corpus;
+    for (unsigned int i = 0; i < n; i++) {
+      std::vector<unsigned int> pitches{60};
+      for (unsigned int j = 0; j < 6 + i; j++) {
+        int step = (int)((seed + i * 7 + j * 5) % 7) - 3;
+        pitches.push_back(std::min(78u, std::max(62u, pitches.back() + step)));
+      }
+      corpus.push_back(
+          ChoraleMocker::mock_sequence(ChoraleMocker::box_pitches(pitches)));
+    }
+    return corpus;
+  };
+
+  auto train_corp = make_corpus(1, 6);
+  auto test_corp = make_corpus(4, 5);
+
+  ChoraleMVS::GenVP<ChoralePitch> pitch_vp(3);
+  ChoraleMVS::GenVP<ChoraleInterval> seqint_vp(3);
+  ChoraleMVS::GenLinkedVP<ChoraleIntref, ChoraleInterval> linked_vp(3);
+  std::vector<const ChoraleMVS::Pred<ChoralePitch> *> vps 
+    { &pitch_vp, &seqint_vp, &linked_vp };
+
+  MVSConfig config;
+  config.enable_short_term = true;
+  config.lt_history = 4;
+  config.st_history = 2;
+  config.intra_layer_bias = 0.7;
+  config.inter_layer_bias = 1.3;
+  config.mvs_name = "test MVS (cache)";
+
+  ThreadPool pool(2);
+  PredictionCache<ChoraleEvent, ChoralePitch> cache(test_corp);
+  REQUIRE( cache.add_untrained(vps, train_corp, 
+        config.lt_history, config.st_history, pool) == 0 );
+  REQUIRE( cache.size() == vps.size() );
+
+  std::vector<std::vector<size_t>> systems { {0}, {1, 0}, {0, 1, 2}, {2, 0} };
+  for (bool short_term : { true, false }) {
+    config.enable_short_term = short_term;
+    for (const auto &system : systems) {
+      ChoraleMVS mvs(config);
+      for (auto i : system)
+        mvs.add_viewpoint(const_cast<ChoraleMVS::Pred<ChoralePitch> *>(vps[i]));
+      for (const auto &piece : train_corp)
+        mvs.learn(piece);
+
+      double expected = 0.0;
+      for (const auto &piece : test_corp)
+        expected += mvs.avg_sequence_entropy<ChoralePitch>(piece);
+      expected /= test_corp.size();
+
+      REQUIRE( cache.cross_entropy(system, config.intra_layer_bias, 
+            config.inter_layer_bias, short_term) == expected );
+    }
+  }
+  SECTION("Caching a trained MVS gives its cross-entropy at any biases") {
+    config.enable_short_term = true;
+    ChoraleMVS mvs(config);
+    for (auto vp : vps)
+      mvs.add_viewpoint(const_cast<ChoraleMVS::Pred<ChoralePitch> *>(vp));
+    for (const auto &piece : train_corp)
+      mvs.learn(piece);
+
+    PredictionCache<ChoraleEvent, ChoralePitch> mvs_cache(test_corp);
+    mvs.cache_predictions(mvs_cache, pool);
+    REQUIRE( mvs_cache.size() == vps.size() );
+
+    for (double inter : { 0.0, 0.5, 2.0 }) {
+      for (double intra : { 0.0, 1.5 }) {
+        mvs.entropy_bias = inter;
+        mvs.set_intra_layer_bias(intra);
+
+        double expected = 0.0;
+        for (const auto &piece : test_corp)
+          expected += mvs.avg_sequence_entropy<ChoralePitch>(piece);
+        expected /= test_corp.size();
+
+        REQUIRE( mvs_cache.cross_entropy(mvs_cache.all_viewpoints(), 
+              intra, inter, mvs.short_term_enabled()) == expected );
+      }
+    }
+  }
+}
+
 TEST_CASE("Check ChoraleEvent template magic") {
   std::vector<ChoraleEvent> test_events {
     ChoraleEvent(
@@ -367,6 +899,43 @@ TEST_CASE("Check GeneralViewpoint works in place of seqint & intref VPs") {
   }
 }
 
+TEST_CASE("Check derived viewpoints give empty predictions without context") {
+  GeneralViewpoint<ChoraleEvent, ChoraleInterval> seqint_vp(3);
+  GeneralViewpoint<ChoraleEvent, ChoraleIntref> intref_vp(3);
+
+  ChoraleFeatures empty_ctx;
+  REQUIRE( !seqint_vp.try_predict(empty_ctx) );
+  REQUIRE( !intref_vp.try_predict(empty_ctx) );
+  REQUIRE_THROWS_AS( seqint_vp.predict(empty_ctx), 
+                     const ViewpointPredictionException & );
+
+  SECTION("Layer skips viewpoints which can't predict") {
+    GeneralViewpoint<ChoraleEvent, ChoralePitch> pitch_vp(3);
+
+    ChoraleVPLayer layer(0.0, 3);
+    layer.add_viewpoint(&seqint_vp);
+    layer.add_viewpoint(&pitch_vp);
+
+    ChoraleVPLayer pitch_only(0.0, 3);
+    pitch_only.add_viewpoint(&pitch_vp);
+
+    auto combined = layer.try_predict<ChoralePitch>(empty_ctx);
+    REQUIRE( combined );
+
+    // combining a single distribution leaves it unchanged
+    auto expected = pitch_only.predict<ChoralePitch>(empty_ctx);
+    for (auto e : EventEnumerator<ChoralePitch>())
+      REQUIRE( combined->probability_for(e) == 
+               Approx(expected.probability_for(e)) );
+
+    ChoraleVPLayer seqint_only(0.0, 3);
+    seqint_only.add_viewpoint(&seqint_vp);
+    REQUIRE( !seqint_only.try_predict<ChoralePitch>(empty_ctx) );
+    REQUIRE_THROWS_AS( seqint_only.predict<ChoralePitch>(empty_ctx),
+                       const ViewpointPredictionException & );
+  }
+}
+
 TEST_CASE("Check GeneralLinkedVP works in place of BasicLinkedVP") {
   ChoraleMVS::BasicLinkedVP<ChoralePitch, ChoraleDuration> basic_vp(3);
   ChoraleMVS::GenLinkedVP<ChoralePitch, ChoraleDuration> gen_vp(3);
@@ -455,3 +1024,471 @@ TEST_CASE("Check posinbar lifting is correct") {
 
 
 
+
+TEST_CASE("Check tabulated reification agrees with reifying from scratch") {
+  // every interval and intref gets a different probability, so a wrong entry
+  // in either table shows up in the reified distribution
+  std::array<double, ChoraleInterval::cardinality> seqint_vals;
+  for (unsigned int i = 0; i < seqint_vals.size(); i++)
+    seqint_vals[i] = (i + 1.0) / (ChoraleInterval::cardinality * 
+                                  (ChoraleInterval::cardinality + 1) / 2.0);
+  EventDistribution<ChoraleInterval> seqint_dist(seqint_vals);
+
+  std::array<double, ChoraleIntref::cardinality> intref_vals;
+  for (unsigned int i = 0; i < intref_vals.size(); i++)
+    intref_vals[i] = (i + 1.0) / (ChoraleIntref::cardinality * 
+                                  (ChoraleIntref::cardinality + 1) / 2.0);
+  EventDistribution<ChoraleIntref> intref_dist(intref_vals);
+
+  auto context = [](const ChoraleKeySig &ks, const ChoralePitch &p) {
+    return ChoraleFeatures(std::vector<ChoraleEvent>{ ChoraleEvent(ks, 
+      ChoraleTimeSig(QuantizedDuration(16)), p, 
+      ChoraleDuration(QuantizedDuration(4)), ChoraleRest(0u)) });
+  };
+
+  // the per-call computations which the tables replaced
+  auto seqint_from_scratch = [&seqint_dist](const ChoralePitch &last_pitch) {
+    std::array<double, ChoralePitch::cardinality> new_values{{0.0}};
+    double total_probability = 0.0;
+    unsigned int valid_predictions = 0;
+    for (auto interval : EventEnumerator<ChoraleInterval>()) {
+      auto midi_interval = interval.midi_interval();
+      if (!last_pitch.is_valid_transposition(midi_interval))
+        continue;
+
+      auto candidate_pitch = last_pitch + midi_interval;
+      auto prob = seqint_dist.probability_for(interval);
+      new_values[candidate_pitch.encode()] = prob;
+      total_probability += prob;
+      valid_predictions++;
+    }
+
+    if (valid_predictions < ChoraleInterval::cardinality) {
+      for (auto &v : new_values)
+        v /= total_probability;
+    }
+    return new_values;
+  };
+
+  auto intref_from_scratch = [&intref_dist](const ChoraleKeySig &ks) {
+    std::array<double, ChoralePitch::cardinality> new_values{{0.0}};
+    double total_probability = 0.0;
+    std::array<MidiPitch, 3> base_pitches{{ 48,60,72 }};
+    for (auto intref : EventEnumerator<ChoraleIntref>()) {
+      for (auto base : base_pitches) {
+        MidiPitch transposed(base.pitch + ks.referent().pitch + 
+                             intref.encode());
+        if (!ChoralePitch::is_valid_pitch(transposed))
+          continue;
+
+        auto prob = intref_dist.probability_for(intref);
+        new_values[ChoralePitch(transposed).encode()] += prob;
+        total_probability += prob;
+      }
+    }
+
+    for (auto &v : new_values)
+      v /= total_probability;
+    return new_values;
+  };
+
+  const ChoraleKeySig c_major(KeySig(0));
+  for (auto pitch : EventEnumerator<ChoralePitch>()) {
+    auto expected = seqint_from_scratch(pitch);
+    auto actual = ChoraleEvent::reify(context(c_major, pitch), seqint_dist);
+    REQUIRE( actual );
+    for (auto e : EventEnumerator<ChoralePitch>())
+      REQUIRE( actual->probability_for(e) == expected[e.encode()] );
+  }
+
+  for (auto ks : EventEnumerator<ChoraleKeySig>()) {
+    auto expected = intref_from_scratch(ks);
+    auto actual = ChoraleEvent::reify(context(ks, ChoralePitch(0u)), 
+                                      intref_dist);
+    REQUIRE( actual );
+    for (auto e : EventEnumerator<ChoralePitch>())
+      REQUIRE( actual->probability_for(e) == expected[e.encode()] );
+  }
+}
+
+TEST_CASE("Check ChoraleFeatures agrees with lifting from scratch") {
+  const ChoraleTimeSig three_four(QuantizedDuration(12));
+
+  std::vector<unsigned> durs  { 4, 2, 2, 4, 4, 8, 8 };
+  std::vector<unsigned> rests { 8, 0, 0, 4, 0, 0, 0 };
+  std::vector<unsigned> raw_pitches { 67, 69, 71, 72, 71, 69, 67 };
+
+  auto boxed_pitches = ChoraleMocker::box_pitches(raw_pitches);
+  auto boxed_durs = ChoraleMocker::box_durations<ChoraleDuration>(durs);
+  auto boxed_rests = ChoraleMocker::box_durations<ChoraleRest>(rests);
+
+  std::vector<ChoraleEvent> events;
+  for (unsigned int i = 0; i < durs.size(); i++) {
+    events.push_back(ChoraleEvent(
+      KeySig(1), three_four, boxed_pitches[i], boxed_durs[i], boxed_rests[i]
+    ));
+  }
+
+  // check incremental construction against lifting every prefix from scratch
+  ChoraleFeatures fs;
+  std::vector<ChoraleEvent> prefix;
+  for (const auto &e : events) {
+    fs.push_back(e);
+    prefix.push_back(e);
+
+    REQUIRE( fs.size() == prefix.size() );
+    REQUIRE( fs.lifted<ChoralePitch>() 
+        == ChoraleEvent::lift<ChoralePitch>(prefix) );
+    REQUIRE( fs.lifted<ChoraleInterval>() 
+        == ChoraleEvent::lift<ChoraleInterval>(prefix) );
+    REQUIRE( fs.lifted<ChoraleIntref>() 
+        == ChoraleEvent::lift<ChoraleIntref>(prefix) );
+    REQUIRE( fs.lifted<ChoralePosinbar>() 
+        == ChoraleEvent::lift<ChoralePosinbar>(prefix) );
+    REQUIRE( fs.lifted<ChoraleFib>() 
+        == ChoraleEvent::lift<ChoraleFib>(prefix) );
+    REQUIRE( fs.lifted<ChoraleIOI>() 
+        == ChoraleEvent::lift<ChoraleIOI>(prefix) );
+    REQUIRE( fs.last_pitch() == e.pitch );
+  }
+
+  SECTION("Truncating to a checkpoint is the same as never going on") {
+    ChoraleFeatures kept;
+    std::vector<ChoraleFeatures::Checkpoint> cps;
+    for (const auto &e : events) {
+      cps.push_back(kept.checkpoint());
+      kept.push_back(e);
+    }
+
+    // go back one event at a time, then carry on with a leap of a major 7th,
+    // which has no seqint, and take that back as well
+    for (size_t n = events.size(); n-- > 1; ) {
+      kept.truncate(cps[n]);
+      ChoraleFeatures expected(std::vector<ChoraleEvent>(
+          events.begin(), events.begin() + n));
+
+      auto cp = kept.checkpoint();
+      auto last = kept.last_pitch().raw_value();
+      ChoralePitch leap(MidiPitch(last < 70 ? last + 11 : last - 11));
+      kept.push_back(ChoraleEvent(events[n].keysig, events[n].timesig, leap,
+                                  events[n].duration, events[n].rest));
+      REQUIRE_THROWS_AS( kept.lifted<ChoraleInterval>(),
+                         const ChoraleTypeError & );
+      kept.truncate(cp);
+
+      REQUIRE( kept.size() == n );
+      REQUIRE( kept.end_offset() == expected.end_offset() );
+      REQUIRE( kept.lifted<ChoralePitch>() == expected.lifted<ChoralePitch>() );
+      REQUIRE( kept.lifted<ChoraleInterval>() 
+          == expected.lifted<ChoraleInterval>() );
+      REQUIRE( kept.lifted<ChoralePosinbar>() 
+          == expected.lifted<ChoralePosinbar>() );
+      REQUIRE( kept.lifted<ChoraleFip>() == expected.lifted<ChoraleFip>() );
+      REQUIRE( kept.lifted<ChoraleIOI>() == expected.lifted<ChoraleIOI>() );
+    }
+
+    kept.truncate(cps[0]);
+    REQUIRE( kept.empty() );
+    kept.push_back(events[0]);
+    REQUIRE( kept.lifted<ChoraleIntref>() 
+        == ChoraleEvent::lift<ChoraleIntref>({ events[0] }) );
+  }
+
+  SECTION("Bad derived types are only reported when lifted") {
+    std::vector<unsigned> leap_pitches { 60, 71 }; // leap of a major 7th
+    auto leap = ChoraleMocker::mock_sequence(
+        ChoraleMocker::box_pitches(leap_pitches));
+    ChoraleFeatures leap_fs(leap);
+    REQUIRE( leap_fs.lifted<ChoralePitch>().size() == 2 );
+    REQUIRE_THROWS_AS( leap_fs.lifted<ChoraleInterval>(), 
+                       const ChoraleTypeError & );
+  }
+}
+
+TEST_CASE("Check viewpoints lift the same sequences from cached features") {
+  std::vector<unsigned> raw_pitches { 67, 69, 71, 72, 71, 69, 67, 66, 67 };
+  std::vector<unsigned> raw_durs    {  4,  2,  2,  4,  4,  8,  4,  4,  8 };
+
+  auto pitches = ChoraleMocker::box_pitches(raw_pitches);
+  auto durs = ChoraleMocker::box_durations<ChoraleDuration>(raw_durs);
+  auto events = ChoraleMocker::mock_sequence(pitches, durs);
+
+  // one copy of each viewpoint learns from the events, the other learns from
+  // the cached features
+  TripleLinkedVP<ChoraleEvent, ChoraleFib, ChoraleInterval, ChoraleIntref>
+    trip_events(3), trip_cached(3);
+  GeneralLinkedVP<ChoraleEvent, ChoralePosinbar, ChoraleDuration> 
+    linked_events(3), linked_cached(3);
+
+  ChoraleFeatures fs(events);
+  trip_events.learn(events);
+  trip_cached.learn(fs);
+  linked_events.learn(events);
+  linked_cached.learn(fs);
+
+  ChoraleFeatures ctx;
+  for (const auto &e : events) {
+    ctx.push_back(e);
+    auto trip_l = trip_events.predict(ctx.events());
+    auto trip_r = trip_cached.predict(ctx);
+    for (auto p : EventEnumerator<ChoralePitch>())
+      REQUIRE( trip_l.probability_for(p) == trip_r.probability_for(p) );
+
+    auto linked_l = linked_events.predict(ctx.events());
+    auto linked_r = linked_cached.predict(ctx);
+    for (auto d : EventEnumerator<ChoraleDuration>())
+      REQUIRE( linked_l.probability_for(d) == linked_r.probability_for(d) );
+  }
+}
+
+TEST_CASE("Check binary corpus round-trips") {
+  ChoraleDataset data;
+  data.domains.pitch = {60, 61, 62, 63, 64, 65, 66, 67, 68, 69, 70, 71, 72,
+                        73, 74, 75, 76, 77, 78, 79, 80, 81};
+  data.domains.duration = {1, 2, 3, 4, 6, 8, 12, 14, 16, 20, 24, 28, 32, 56, 64};
+  data.domains.keysig = {-4, -3, -2, -1, 0, 1, 2, 3, 4};
+  data.domains.timesig = {12, 16};
+  data.domains.rest = {0, 4, 8, 12, 16, 20};
+
+  auto pitches = ChoraleMocker::box_pitches({60,62,64,65,67,81});
+  auto durs = ChoraleMocker::box_durations<ChoraleDuration>({1,2,4,8,16,64});
+  data.train.push_back(ChoraleMocker::mock_sequence(pitches, durs));
+  data.train.push_back(ChoraleMocker::mock_sequence(
+        ChoraleMocker::box_durations<ChoraleDuration>({4,8,4}), 
+        ChoraleTimeSig(0)));
+  data.test.push_back(ChoraleMocker::mock_sequence(
+        ChoraleMocker::box_durations<ChoraleRest>({0,4,20,8})));
+
+  const std::string fname = "corpus_roundtrip_test.bin";
+
+  // removes the file however the test ends
+  struct RemoveOnExit {
+    const std::string &fname;
+    ~RemoveOnExit() { std::remove(fname.c_str()); }
+  } remove_on_exit{fname};
+
+  write_binary_corpus(fname, data);
+  auto loaded = load_binary_corpus(fname);
+
+  REQUIRE( loaded.domains.pitch == data.domains.pitch );
+  REQUIRE( loaded.domains.keysig == data.domains.keysig );
+  REQUIRE( loaded.domains.rest == data.domains.rest );
+
+  auto check_subcorpus = [](const ChoraleCorpus &l, const ChoraleCorpus &r) {
+    REQUIRE( l.size() == r.size() );
+    for (unsigned int i = 0; i < l.size(); i++) {
+      REQUIRE( l[i].size() == r[i].size() );
+      for (unsigned int j = 0; j < l[i].size(); j++) {
+        REQUIRE( l[i][j].keysig.encode() == r[i][j].keysig.encode() );
+        REQUIRE( l[i][j].timesig.encode() == r[i][j].timesig.encode() );
+        REQUIRE( l[i][j].pitch.encode() == r[i][j].pitch.encode() );
+        REQUIRE( l[i][j].duration.encode() == r[i][j].duration.encode() );
+        REQUIRE( l[i][j].rest.encode() == r[i][j].rest.encode() );
+      }
+    }
+  };
+  check_subcorpus(loaded.train, data.train);
+  check_subcorpus(loaded.test, data.test);
+
+  SECTION("Streaming a binary corpus gives each piece in order") {
+    ChoraleCorpus streamed_train, streamed_test;
+    stream_binary_corpus(fname, 
+      [&](CorpusPart part, std::vector<ChoraleEvent> &&chorale) {
+        auto &subcorp = (part == CorpusPart::train) ? 
+          streamed_train : streamed_test;
+        subcorp.push_back(std::move(chorale));
+      });
+    check_subcorpus(streamed_train, data.train);
+    check_subcorpus(streamed_test, data.test);
+  }
+
+  SECTION("Truncated files are rejected") {
+    std::string bytes;
+    {
+      std::ifstream is(fname, std::ios::binary);
+      bytes.assign(std::istreambuf_iterator<char>(is),
+                   std::istreambuf_iterator<char>());
+    }
+    {
+      std::ofstream os(fname, std::ios::binary);
+      os.write(bytes.data(), bytes.size() - 2);
+    }
+    REQUIRE_THROWS_AS( load_binary_corpus(fname), const CorpusError & );
+  }
+
+  SECTION("Corrupt domain sizes are rejected before allocating") {
+    std::fstream fs(fname, std::ios::in | std::ios::out | std::ios::binary);
+    // the size of the pitch domain follows the magic and the version
+    fs.seekp(8);
+    const uint32_t huge = 0xffffffff;
+    fs.write(reinterpret_cast<const char *>(&huge), sizeof(huge));
+    fs.close();
+    REQUIRE_THROWS_AS( load_binary_corpus(fname), const CorpusError & );
+  }
+
+  SECTION("Domains that don't match the chorale types are rejected") {
+    std::swap(data.domains.duration[0], data.domains.duration[1]);
+    REQUIRE_THROWS_AS( write_binary_corpus(fname, data), const CorpusError & );
+  }
+}
+
+TEST_CASE("Check streaming JSON corpus parser") {
+  const std::string corpus_json = R"({
+    "metadata": {
+      "pitch_domain": [60, 61, 62, 63, 64, 65, 66, 67],
+      "duration_domain": [1, 2, 3, 4],
+      "keysig_domain": [-4, -3, -2, -1, 0, 1],
+      "timesig_domain": [12, 16],
+      "rest_domain": [0, 4, 8],
+      "seqint_domain": [-12, -9, -8]
+    },
+    "corpus": {
+      "train": [
+        {"title": "Gott gen\u00e4dig \"sein\"", "bwv": "347", "time_sig_amt": 16,
+         "key_sig_sharps": -1, "extra": {"a": [1.5, true, null]},
+         "notes": [[65, 12, 4], [67, 16, 2], [64, 22, 1]]},
+        {"notes": [[60, 0, 3], [62, 3, 1]], "time_sig_amt": 12,
+         "key_sig_sharps": 1}
+      ],
+      "validate": [
+        {"title": "", "time_sig_amt": 16, "key_sig_sharps": 0,
+         "notes": [[61, 0, 4], [63, 4, 4]]}
+      ]
+    }
+  })";
+
+  std::istringstream is(corpus_json);
+  std::vector<CorpusPart> parts;
+  ChoraleCorpus chorales;
+  auto domains = stream_json_corpus(is, 
+    [&](CorpusPart part, std::vector<ChoraleEvent> &&chorale) {
+      parts.push_back(part);
+      chorales.push_back(std::move(chorale));
+    });
+
+  REQUIRE( domains.pitch.size() == 8 );
+  REQUIRE( domains.keysig.front() == -4 );
+  REQUIRE( (parts == std::vector<CorpusPart>
+        { CorpusPart::train, CorpusPart::train, CorpusPart::test }) );
+
+  REQUIRE( chorales[0].size() == 3 );
+  REQUIRE( chorales[0][0].keysig.raw_value() == (unsigned int)-1 );
+  REQUIRE( chorales[0][0].timesig.raw_value() == 16 );
+  REQUIRE( chorales[0][0].pitch.raw_value() == 65 );
+  REQUIRE( chorales[0][0].rest.raw_value() == 12 );
+  REQUIRE( chorales[0][1].duration.raw_value() == 2 );
+  REQUIRE( chorales[0][1].rest.raw_value() == 0 );
+  REQUIRE( chorales[0][2].rest.raw_value() == 4 );
+  REQUIRE( chorales[1][0].timesig.raw_value() == 12 );
+  REQUIRE( chorales[1][1].pitch.raw_value() == 62 );
+  REQUIRE( chorales[2][1].pitch.raw_value() == 63 );
+
+  SECTION("Malformed corpora are rejected") {
+    auto sink = [](CorpusPart, std::vector<ChoraleEvent> &&) {};
+    for (auto bad : { corpus_json.substr(0, corpus_json.size() / 2),
+                      corpus_json + "]",
+                      std::string(R"({"corpus": {}})"),
+                      std::string(R"({"metadata": {"rest_domain": [0, 8]}})") }) {
+      std::istringstream bad_is(bad);
+      REQUIRE_THROWS_AS( stream_json_corpus(bad_is, sink), 
+                         const CorpusError & );
+    }
+  }
+
+  SECTION("Pieces which the chorale types can't represent are rejected") {
+    auto sink = [](CorpusPart, std::vector<ChoraleEvent> &&) {};
+    auto piece_json = [](const std::string &notes) {
+      return R"({"corpus": {"train": [{"time_sig_amt": 16, )"
+        R"("key_sig_sharps": 0, "notes": )" + notes + "}]}}";
+    };
+
+    for (auto notes : { "[[60, 0, 4], [62, 2, 4]]",  // overlapping notes
+                        "[[60, 0, 4]]",              // only one note
+                        "[[60, 0, 4], [59, 4, 4]]",  // pitch out of range
+                        "[[60, 0, 5], [62, 5, 4]]",  // no such duration
+                        "[[60, 0, 4], [62, 6, 4]]" } // no such rest
+        ) {
+      std::istringstream bad_is(piece_json(notes));
+      REQUIRE_THROWS_AS( stream_json_corpus(bad_is, sink), 
+                         const CorpusError & );
+    }
+  }
+}
+
+TEST_CASE("Check FlatCorpus agrees with the nested corpus") {
+  ChoraleCorpus corpus;
+  for (unsigned int i = 0; i < 7; i++) {
+    std::vector<unsigned int> pitches;
+    for (unsigned int j = 0; j < 4 + i; j++)
+      pitches.push_back(60 + (i * 3 + j * 5) % 9);
+    corpus.push_back(
+        ChoraleMocker::mock_sequence(ChoraleMocker::box_pitches(pitches)));
+  }
+  corpus.push_back(ChoraleMocker::mock_sequence(
+        ChoraleMocker::box_durations<ChoraleDuration>({4,8,4,2,2}), 
+        ChoraleTimeSig(0)));
+
+  FlatCorpus flat(corpus);
+  REQUIRE( flat.size() == corpus.size() );
+
+  size_t total = 0;
+  for (unsigned int i = 0; i < corpus.size(); i++) {
+    auto view = flat[i];
+    REQUIRE( view.size() == corpus[i].size() );
+    REQUIRE( view.keysig() == corpus[i].front().keysig );
+    REQUIRE( view.timesig() == corpus[i].front().timesig );
+
+    unsigned int j = 0;
+    for (auto e : view) {
+      const auto &expected = corpus[i][j++];
+      REQUIRE( e.pitch == expected.pitch );
+      REQUIRE( e.duration == expected.duration );
+      REQUIRE( e.rest == expected.rest );
+      REQUIRE( e.timesig == expected.timesig );
+    }
+    REQUIRE( j == corpus[i].size() );
+    total += j;
+  }
+  REQUIRE( flat.num_events() == total );
+
+  auto unpacked = flat.unpack();
+  REQUIRE( unpacked.size() == corpus.size() );
+  for (unsigned int i = 0; i < corpus.size(); i++)
+    for (unsigned int j = 0; j < corpus[i].size(); j++)
+      REQUIRE( unpacked[i][j].pitch == corpus[i][j].pitch );
+
+  SECTION("Evaluating pieces from a FlatCorpus gives the same entropies") {
+    MVSConfig config;
+    config.enable_short_term = true;
+    config.lt_history = 3;
+    config.st_history = 2;
+    ChoraleMVS mvs(config);
+    ChoraleMVS::GenVP<ChoralePitch> pitch_vp(3);
+    ChoraleMVS::GenVP<ChoraleDuration> duration_vp(3);
+    ChoraleMVS::GenVP<ChoraleRest> rest_vp(3);
+    mvs.add_viewpoint(&pitch_vp);
+    mvs.add_viewpoint(&duration_vp);
+    mvs.add_viewpoint(&rest_vp);
+    for (unsigned int i = 0; i < flat.size(); i++)
+      mvs.learn(flat[i].events());
+
+    ThreadPool pool(2);
+    auto expected = mvs.corpus_entropies(corpus, pool);
+    auto actual = mvs.corpus_entropies(flat.size(), 
+        [&flat](size_t i) { return flat[i].events(); }, pool);
+    REQUIRE( actual.size() == expected.size() );
+    for (unsigned int i = 0; i < actual.size(); i++) {
+      REQUIRE( actual[i].pitch == expected[i].pitch );
+      REQUIRE( actual[i].duration == expected[i].duration );
+      REQUIRE( actual[i].rest == expected[i].rest );
+    }
+  }
+
+  SECTION("Bad codes are rejected") {
+    const unsigned char codes[] = { 0, 0, 0, 0, ChoraleDuration::cardinality, 0 };
+    REQUIRE_THROWS_AS( flat.append_codes(0, 0, codes, 2), 
+                       const CorpusError & );
+    REQUIRE( flat.size() == corpus.size() );
+    REQUIRE( flat.num_events() == total );
+  }
+}
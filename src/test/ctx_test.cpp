@@ -3,6 +3,10 @@
 #include <iostream>
 #include <string>
 #include <cmath>
+#include <array>
+#include <set>
+#include <functional>
+#include <algorithm>
 
 #define CATCH_CONFIG_MAIN
 #include "catch.hpp"
@@ -214,6 +218,161 @@ TEST_CASE("Context model calculates correct probabilities using PPM A",
 }
 
 
+TEST_CASE("Successor distribution agrees with PPM A for each candidate",
+    "[ctxmodel][ppm-a]") {
+  ContextModel<4> model(3);
+  model.learn_sequence(encode_string("GGDBAGGABA"));
+
+  // includes contexts which are (partially) novel and longer than h
+  std::vector<std::string> contexts = 
+    { "", "G", "D", "GA", "DD", "BAG", "ABABABGA" };
+
+  for (const auto &ctx_str : contexts) {
+    auto ctx = encode_string(ctx_str);
+    SparseSuccessors succ;
+    model.successors(ctx, succ);
+
+    std::array<double, 4> values;
+    values.fill(succ.unseen);
+    for (const auto &kv : succ.seen)
+      values[kv.first] = kv.second;
+
+    double total = 0.0;
+    for (unsigned int e = 0; e < 4; e++) {
+      auto seq = ctx;
+      seq.push_back(e);
+      REQUIRE( values[e] == model.probability_of(seq) );
+      total += values[e];
+    }
+
+    REQUIRE( total == Approx(1.0) );
+  }
+}
+
+TEST_CASE("Successors on a large alphabet only visit the children present",
+    "[ctxmodel][ppm-a]") {
+  // a few events scattered over a large alphabet: successors should walk the
+  // children each context has, and still agree with PPM A
+  const unsigned int big = 4096;
+  ContextModel<big> model(2);
+  std::vector<unsigned int> seq = { 4000, 7, 4000, 1234, 7, 4000, 7, 3 };
+  model.learn_sequence(seq);
+
+  // every node lists its children in order, matching its mask
+  std::function<void(const TrieNode<big> &)> check_node =
+    [&](const TrieNode<big> &node) {
+    REQUIRE( node.child_codes.size() == node.child_mask.count() );
+    REQUIRE( std::is_sorted(node.child_codes.begin(), node.child_codes.end()) );
+    for (auto code : node.child_codes) {
+      REQUIRE( node.child_mask[code] );
+      check_node(*node.children[code]);
+    }
+  };
+
+  SECTION("Successors agree with PPM A") {
+    for (auto ctx : std::vector<std::vector<unsigned int>>
+         { {}, {4000}, {7, 4000}, {3}, {1234, 1234} }) {
+      SparseSuccessors succ;
+      model.successors(ctx, succ);
+
+      std::set<unsigned int> listed;
+      for (const auto &kv : succ.seen) {
+        auto next = ctx;
+        next.push_back(kv.first);
+        REQUIRE( kv.second == model.probability_of(next) );
+        listed.insert(kv.first);
+      }
+      REQUIRE( listed.size() == succ.seen.size() );
+      REQUIRE( listed.size() <= 4 );
+
+      auto next = ctx;
+      next.push_back(big - 1);
+      REQUIRE( succ.unseen == model.probability_of(next) );
+    }
+  }
+
+  SECTION("Children stay listed in order as the model changes") {
+    check_node(model.get_root());
+    model.learn_sequence({ 2, 4000, 5 });
+    check_node(model.get_root());
+
+    ContextModel<big> copy(model);
+    check_node(copy.get_root());
+
+    model.unlearn_sequence(seq);
+    check_node(model.get_root());
+    model.clear_model();
+    REQUIRE( model.get_root().child_codes.empty() );
+  }
+}
+
+TEST_CASE("Cursors follow a growing context", "[ctxmodel][ppm-a]") {
+  ContextModel<NUM_NOTES> model(HISTORY);
+  model.learn_sequence(encode_string("GGDBAGGABA"));
+
+  // the successors at the cursor should agree with PPM A on the whole context
+  auto check_cursor = [](const ContextModel<NUM_NOTES> &m,
+                         const ContextModel<NUM_NOTES>::Cursor &cursor,
+                         const std::vector<unsigned int> &ctx) {
+    SparseSuccessors succ;
+    m.successors(cursor, succ);
+
+    std::array<double, NUM_NOTES> values;
+    values.fill(succ.unseen);
+    for (const auto &kv : succ.seen)
+      values[kv.first] = kv.second;
+
+    for (unsigned int e = 0; e < NUM_NOTES; e++) {
+      auto seq = ctx;
+      seq.push_back(e);
+      REQUIRE( values[e] == m.probability_of(seq) );
+    }
+  };
+
+  SECTION("Appending to a cursor on a fixed model") {
+    ContextModel<NUM_NOTES>::Cursor cursor(model);
+    std::vector<unsigned int> ctx;
+    check_cursor(model, cursor, ctx);
+
+    for (auto e : encode_string("GGABDDAGGDB")) {
+      ctx.push_back(e);
+      cursor.append(e);
+      check_cursor(model, cursor, ctx);
+    }
+
+    // "DB" was seen in training, "GDB" wasn't
+    REQUIRE( cursor.matched_length() == 2 );
+    cursor.reset();
+    REQUIRE( cursor.matched_length() == 0 );
+  }
+
+  SECTION("Following a context while the model learns it") {
+    ContextModel<NUM_NOTES> online(HISTORY);
+    ContextModel<NUM_NOTES>::Cursor cursor(online);
+    std::vector<unsigned int> ctx;
+
+    for (auto e : encode_string("GAGBGDDBDADGGA")) {
+      cursor.follow(ctx);
+      check_cursor(online, cursor, ctx);
+      ctx.push_back(e);
+      online.update_from_tail(ctx);
+    }
+  }
+
+  SECTION("Following contexts which jump around, with nodes removed") {
+    ContextModel<NUM_NOTES>::Cursor cursor(model);
+    for (auto ctx : { "GGA", "GGAB", "D", "", "BAG" }) {
+      cursor.follow(encode_string(ctx));
+      check_cursor(model, cursor, encode_string(ctx));
+    }
+
+    model.unlearn_sequence(encode_string("GGDBAGGABA"));
+    model.learn_sequence(encode_string("GAGBGDDBDADG"));
+    cursor.follow(encode_string("BAG"));
+    check_cursor(model, cursor, encode_string("BAG"));
+  }
+}
+
 TEST_CASE("Context model correctly calculates average entropy of sequence", 
     "[ctxmodel][ppm-a]") {
   ContextModel<NUM_NOTES> model(HISTORY);
@@ -292,3 +451,123 @@ TEST_CASE("Test resetting/clearing of context model") {
   }
 }
 
+
+TEST_CASE("Unlearning a sequence undoes learning it", "[ctxmodel]") {
+  ContextModel<NUM_NOTES> control(HISTORY);
+  ContextModel<NUM_NOTES> test(HISTORY);
+  std::string kept("GAGBGDDBDADG");
+  std::string removed("DDDABBGADB");
+  control.learn_sequence(encode_string(kept));
+  test.learn_sequence(encode_string(removed));
+  test.learn_sequence(encode_string(kept));
+  test.unlearn_sequence(encode_string(removed));
+
+  // the trie should have exactly the same n-grams (with the same counts), so
+  // in particular n-grams only seen in the removed sequence must be gone
+  for (unsigned int n = 1; n <= HISTORY; n++) {
+    std::list<Ngram> expected, actual;
+    control.get_ngrams(n, expected);
+    test.get_ngrams(n, actual);
+    REQUIRE( actual == expected );
+  }
+
+  REQUIRE( test.count_of({}) == control.count_of({}) );
+  REQUIRE( test.count_of(encode_string("DDD")) == 0 );
+
+  for (auto ctx : { "", "G", "DA", "BGD", "DDD" }) {
+    SparseSuccessors expected, actual;
+    control.successors(encode_string(ctx), expected);
+    test.successors(encode_string(ctx), actual);
+    REQUIRE( actual.seen == expected.seen );
+    REQUIRE( actual.unseen == expected.unseen );
+  }
+
+  SECTION("Unlearning everything leaves an empty model") {
+    test.unlearn_sequence(encode_string(kept));
+    REQUIRE( test.count_of({}) == 0 );
+    for (unsigned int n = 1; n <= HISTORY; n++) {
+      std::list<Ngram> ngrams;
+      test.get_ngrams(n, ngrams);
+      REQUIRE( ngrams.empty() );
+    }
+  }
+}
+
+TEST_CASE("Rolling back to a checkpoint undoes online training", "[ctxmodel]") {
+  // the model as it was at each step of training online on a sequence
+  std::string piece("GAGBGDDBDADGGA");
+  std::vector<ContextModel<NUM_NOTES>> snapshots;
+  ContextModel<NUM_NOTES> online(HISTORY);
+  online.learn_sequence(encode_string("DDDABBGADB"));
+
+  std::vector<size_t> marks;
+  std::vector<unsigned int> seq;
+  for (auto c : piece) {
+    snapshots.push_back(online);
+    marks.push_back(online.checkpoint());
+    seq.push_back(encode(c));
+    online.update_from_tail(seq);
+  }
+
+  auto same_model = [](ContextModel<NUM_NOTES> &expected,
+                       ContextModel<NUM_NOTES> &actual) {
+    for (unsigned int n = 1; n <= HISTORY; n++) {
+      std::list<Ngram> expected_ngrams, actual_ngrams;
+      expected.get_ngrams(n, expected_ngrams);
+      actual.get_ngrams(n, actual_ngrams);
+      REQUIRE( actual_ngrams == expected_ngrams );
+    }
+    REQUIRE( actual.count_of({}) == expected.count_of({}) );
+  };
+
+  SECTION("Rolling back step by step") {
+    ContextModel<NUM_NOTES>::Cursor cursor(online);
+    cursor.follow(seq);
+
+    // marks nest, so each rollback takes back one more step
+    for (size_t i = marks.size(); i-- > 0; ) {
+      online.rollback(marks[i]);
+      seq.pop_back();
+      same_model(snapshots[i], online);
+
+      // cursors notice the nodes that have gone
+      cursor.follow(seq);
+      SparseSuccessors expected, actual;
+      snapshots[i].successors(seq, expected);
+      online.successors(cursor, actual);
+      REQUIRE( actual.seen == expected.seen );
+      REQUIRE( actual.unseen == expected.unseen );
+    }
+  }
+
+  SECTION("Rolling back and branching") {
+    online.rollback(marks[5]);
+    same_model(snapshots[5], online);
+
+    // carrying on differently from the checkpoint is the same as training
+    // the other branch from the start
+    std::vector<unsigned int> branch(seq.begin(), seq.begin() + 5);
+    for (auto c : std::string("ABBA")) {
+      branch.push_back(encode(c));
+      online.update_from_tail(branch);
+      snapshots[5].update_from_tail(branch);
+    }
+    same_model(snapshots[5], online);
+
+    online.rollback(marks[0]);
+    same_model(snapshots[0], online);
+  }
+
+  SECTION("Releasing checkpoints keeps what was learned") {
+    online.release_checkpoints();
+    ContextModel<NUM_NOTES> control(HISTORY);
+    control.learn_sequence(encode_string("DDDABBGADB"));
+    for (size_t i = 1; i <= seq.size(); i++)
+      control.update_from_tail(
+          std::vector<unsigned int>(seq.begin(), seq.begin() + i));
+    same_model(control, online);
+
+    // and lets the model be unlearned from again
+    online.unlearn_sequence(encode_string("DDDABBGADB"));
+  }
+}
@@ -3,10 +3,12 @@
 #include <fstream>
 #include <string>
 #include <array>
+#include <thread>
 
 #include "catch.hpp"
 #include "event.hpp"
 #include "sequence_model.hpp"
+#include "golden_section.hpp"
 #include "json.hpp"
 
 using json = nlohmann::json; // to load pre-gen'd test cases
@@ -78,6 +80,40 @@ TEST_CASE("zip_tail for event pairs works correctly", "[event]") {
   REQUIRE( expected_rl == zipped_rl );
 }
 
+TEST_CASE("Marginalising pairs agrees with summing over events", "[event]") {
+  using T_right = EventPair<DummyEvent, DummyEvent>;
+  using T_pair = EventPair<DummyEvent, T_right>;
+
+  // some arbitrary (unnormalised) joint values
+  std::array<double, T_pair::cardinality> joint;
+  for (unsigned int i = 0; i < T_pair::cardinality; i++)
+    joint[i] = (double)((i * 7) % 11) / 64.0;
+
+  std::array<double, T_right::cardinality> expected{{0.0}};
+  for (auto e_right : EventEnumerator<T_right>())
+    for (auto e_left : EventEnumerator<DummyEvent>())
+      expected[e_right.encode()] += joint[T_pair(e_left, e_right).encode()];
+
+  REQUIRE( T_pair::marginalise_left(joint) == expected );
+
+  SECTION("Sparse joint gives the same marginal") {
+    // list every third pair explicitly, the rest share the same value
+    const double unseen = 1.0 / 128.0;
+    std::vector<std::pair<unsigned int, double>> seen;
+    for (unsigned int i = 0; i < T_pair::cardinality; i++) {
+      if (i % 3 == 0)
+        seen.push_back({i, joint[i]});
+      else
+        joint[i] = unseen;
+    }
+
+    auto dense = T_pair::marginalise_left(joint);
+    auto sparse = T_pair::marginalise_left(seen, unseen);
+    for (unsigned int r = 0; r < T_right::cardinality; r++)
+      REQUIRE( sparse[r] == Approx(dense[r]) );
+  }
+}
+
 TEST_CASE("SequenceModel correctly abstracts around ContextModel", 
     "[seqmodel]") { 
   SequenceModel<DummyEvent> seq_model(3);
@@ -178,6 +214,85 @@ TEST_CASE("SequenceModel distribtuion construction works correctly",
   }
 }
 
+TEST_CASE("Cached successor distributions agree with the model", 
+    "[seqmodel]") {
+  SequenceModel<DummyEvent> control(3);
+  SequenceModel<DummyEvent> cached(3);
+  control.learn_sequence(str_to_events("GGDBAGGABA"));
+  cached.learn_sequence(str_to_events("GGDBAGGABA"));
+  cached.set_cache_capacity(2);
+
+  auto check = [&control, &cached](const std::string &ctx) {
+    auto expected = control.gen_successor_dist(str_to_events(ctx));
+    auto actual = cached.gen_successor_dist(str_to_events(ctx));
+    for (auto e : { 'G', 'A', 'B', 'D' })
+      REQUIRE( actual.probability_for(DummyEvent(e)) == 
+               expected.probability_for(DummyEvent(e)) );
+  };
+
+  // only the last (h-1) events are part of the key, so "BGG" hits "GG"
+  for (auto ctx : { "GG", "A", "GG", "BGG", "D", "A", "GG" })
+    check(ctx);
+
+  // GG hits twice, then D evicts A (the least recently used) and A in turn
+  // evicts GG, so the last three lookups miss
+  auto stats = cached.cache_stats();
+  REQUIRE( stats.hits == 2 );
+  REQUIRE( stats.misses == 5 );
+
+  SECTION("Learning empties the cache") {
+    control.learn_sequence(str_to_events("DDBAD"));
+    cached.learn_sequence(str_to_events("DDBAD"));
+    check("A");
+    check("GG");
+    REQUIRE( cached.cache_stats().hits == 2 );
+  }
+
+  SECTION("Large caches are split into shards") {
+    // 4 shards of 64 entries, shared by several threads. each thread cycles
+    // through few enough keys that they stay cached between rounds, so there
+    // are hits however the threads are scheduled
+    SuccessorCache cache(256);
+    auto succ_for = [](unsigned int i) {
+      return SparseSuccessors{ {{i % 4, 0.5}}, 0.5 / (i + 1) };
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < 4; t++) {
+      threads.emplace_back([&cache, &succ_for, t]() {
+        SparseSuccessors result;
+        for (unsigned int i = 0; i < 1000; i++) {
+          std::vector<unsigned int> key{ i % 100, t % 2 };
+          if (!cache.lookup(key, result))
+            cache.insert(key, succ_for(i % 100 + 1000 * (t % 2)));
+        }
+      });
+    }
+    for (auto &thread : threads)
+      thread.join();
+
+    REQUIRE( cache.size() <= 256 );
+    auto stats = cache.get_stats();
+    REQUIRE( stats.hits + stats.misses == 4000 );
+    REQUIRE( stats.hits > 0 );
+
+    // whatever is still cached is what was inserted for that key
+    SparseSuccessors result;
+    unsigned int found = 0;
+    for (unsigned int k = 0; k < 100; k++) {
+      for (unsigned int parity = 0; parity < 2; parity++) {
+        if (!cache.lookup({k, parity}, result))
+          continue;
+        found++;
+        auto expected = succ_for(k + 1000 * parity);
+        REQUIRE( result.unseen == expected.unseen );
+        REQUIRE( result.seen == expected.seen );
+      }
+    }
+    REQUIRE( found == cache.size() );
+  }
+}
+
 TEST_CASE("Check entropy calculations", "[seqmodel]") {
   std::array<double, 4> values{{0.5, 0.25, 0.125, 0.125}};
   EventDistribution<DummyEvent> dist(values);
@@ -201,6 +316,63 @@ TEST_CASE("Check entropy calculations", "[seqmodel]") {
   }
 }
 
+TEST_CASE("Truncating distributions for top-k and top-p sampling", 
+    "[seqmodel]") {
+  std::array<double, 4> values{{0.125, 0.5, 0.125, 0.25}};
+  EventDistribution<DummyEvent> dist(values);
+
+  SECTION("Most probable events") {
+    auto top = dist.most_probable(3);
+    REQUIRE( top.size() == 3 );
+    REQUIRE( top[0].encode() == 1 );
+    REQUIRE( top[1].encode() == 3 );
+    REQUIRE( top[2].encode() == 0 ); // tie with 2 goes to the lower code
+    REQUIRE( dist.most_probable(10).size() == 4 );
+  }
+
+  SECTION("Top-k") {
+    auto top2 = dist.top_k(2);
+    REQUIRE( top2.probability_for_code(0) == 0.0 );
+    REQUIRE( top2.probability_for_code(1) == Approx(2.0/3.0) );
+    REQUIRE( top2.probability_for_code(2) == 0.0 );
+    REQUIRE( top2.probability_for_code(3) == Approx(1.0/3.0) );
+
+    for (unsigned int k : {0u, 4u}) {
+      auto all = dist.top_k(k);
+      for (unsigned int i = 0; i < 4; i++)
+        REQUIRE( all.probability_for_code(i) == values[i] );
+    }
+  }
+
+  SECTION("Top-p") {
+    // the nucleus is the fewest events with at least p of the probability
+    REQUIRE( dist.top_p(0.5).probability_for_code(1) == 1.0 );
+    auto nucleus = dist.top_p(0.6);
+    REQUIRE( nucleus.probability_for_code(1) == Approx(2.0/3.0) );
+    REQUIRE( nucleus.probability_for_code(3) == Approx(1.0/3.0) );
+    REQUIRE( nucleus.probability_for_code(0) == 0.0 );
+
+    auto all = dist.top_p(1.0);
+    for (unsigned int i = 0; i < 4; i++)
+      REQUIRE( all.probability_for_code(i) == values[i] );
+  }
+
+  SECTION("Masking") {
+    EventMask<DummyEvent> allowed;
+    allowed.set(0);
+    allowed.set(3);
+    auto masked = dist.masked(allowed);
+    REQUIRE( masked.probability_for_code(0) == Approx(1.0/3.0) );
+    REQUIRE( masked.probability_for_code(1) == 0.0 );
+    REQUIRE( masked.probability_for_code(2) == 0.0 );
+    REQUIRE( masked.probability_for_code(3) == Approx(2.0/3.0) );
+
+    // truncating after masking only keeps allowed events
+    auto top = masked.top_k(1);
+    REQUIRE( top.probability_for_code(3) == 1.0 );
+  }
+}
+
 TEST_CASE("Weighted entropy combination works as expected", "[seqmodel]") {
   using array_t = std::array<double, 4>;
 
@@ -287,5 +459,26 @@ TEST_CASE("Weighted entropy combination matches numpy-generated examples",
   }
 }
 
+TEST_CASE("Golden-section search finds the minimum of a convex function",
+    "[optimise]") {
+  unsigned int evaluations = 0;
+  auto parabola = [&evaluations](double x) {
+    evaluations++;
+    return (x - 0.3) * (x - 0.3) + 2.0;
+  };
+
+  auto x = golden_section_minimise(parabola, 0.0, 2.0, 1e-6);
+  REQUIRE( std::abs(x - 0.3) < 1e-6 );
 
+  // one evaluation per step (after the first two), shrinking by 1/phi each
+  const double phi = (1.0 + std::sqrt(5.0)) / 2.0;
+  auto steps = std::ceil(std::log(2.0 / 1e-6) / std::log(phi));
+  REQUIRE( evaluations <= steps + 2 );
 
+  SECTION("Minima at the ends of the interval") {
+    auto rising = [](double x) { return std::exp(x); };
+    REQUIRE( golden_section_minimise(rising, 0.0, 1.0, 1e-6) < 1e-6 );
+    auto falling = [](double x) { return -x * x; };
+    REQUIRE( golden_section_minimise(falling, 0.0, 1.0, 1e-6) > 1.0 - 1e-6 );
+  }
+}
@@ -17,6 +17,35 @@ TEST_CASE("xoroshiro seeding gives same results via array and lambda") {
     REQUIRE( eng_1() == eng_2() );
 }
 
+TEST_CASE("xoroshiro jumps give distinct, reproducible streams") {
+  xoroshiro128plus_engine base;
+  base.seed({{ 314, 42, 2718, 99 }});
+
+  auto jumped = base;
+  jumped.jump();
+  auto jumped_again = base;
+  jumped_again.jump();
+
+  // the jump is a polynomial in the engine's transition, so it commutes with
+  // stepping the engine
+  auto stepped = base;
+  stepped();
+  stepped.jump();
+  auto jumped_then_stepped = base;
+  jumped_then_stepped.jump();
+  jumped_then_stepped();
+
+  REQUIRE( stepped() == jumped_then_stepped() );
+
+  bool any_differ = false;
+  for (int i = 0; i < 10; i++) {
+    auto x = jumped();
+    REQUIRE( x == jumped_again() );
+    any_differ |= (x != base());
+  }
+  REQUIRE( any_differ );
+}
+
 TEST_CASE("sanity check constant random source") {
   REQUIRE( ConstantSource{0.0}.sample() == 0.0 );
   REQUIRE( ConstantSource{0.5}.sample() == 0.5 );
@@ -107,4 +136,61 @@ TEST_CASE("Distribution sampling works correctly") {
   }
 }
 
+// steps evenly through [0,1), so that sampling with it is like integrating
+// over the distribution
+class GridSource : public RandomSource {
+  const unsigned int steps;
+  unsigned int i;
+public:
+  GridSource(unsigned int n) : steps(n), i(0) {}
+  double sample() override { return (i++ % steps + 0.5) / steps; }
+};
+
+TEST_CASE("Sampling never draws events with zero probability") {
+  // (e.g. events masked out for constrained generation)
+  std::array<double, BrubeckEvent::cardinality>
+    dist_vals{{0.0, 0.5, 0.0, 0.5, 0.0}};
+  EventDistribution<BrubeckEvent> dist{dist_vals};
+
+  ConstantSource bottom(0.0);
+  ConstantSource top(1.0); // as if rounding left the total short
+  REQUIRE( dist.sample_with_source(&bottom).encode() == 1 );
+  REQUIRE( dist.sample_with_source(&top).encode() == 3 );
 
+  GridSource grid(100);
+  for (unsigned int i = 0; i < 100; i++) {
+    auto code = dist.sample_with_source(&grid).encode();
+    REQUIRE( (code == 1 || code == 3) );
+  }
+}
+
+TEST_CASE("Alias sampling reproduces the distribution") {
+  std::array<double, BrubeckEvent::cardinality>
+    dist_vals{{1.0/6.0, 1.0/3.0, 0.0, 0.4, 0.1}};
+  EventDistribution<BrubeckEvent> dist{dist_vals};
+  AliasSampler<BrubeckEvent> sampler(dist);
+
+  const unsigned int steps = 60000;
+  std::array<unsigned int, BrubeckEvent::cardinality> counts{{0}};
+
+  SECTION("Sampling one at a time") {
+    GridSource grid(steps);
+    for (unsigned int i = 0; i < steps; i++)
+      counts[sampler.sample_with_source(&grid).encode()]++;
+  }
+
+  SECTION("Sampling a batch from the distribution") {
+    GridSource grid(steps);
+    std::vector<BrubeckEvent> samples;
+    dist.sample_n(steps, std::back_inserter(samples), &grid);
+    REQUIRE( samples.size() == steps );
+    for (const auto &e : samples)
+      counts[e.encode()]++;
+  }
+
+  // each column covers steps/5 grid points, so the frequencies are exact up to
+  // a grid point or two per column
+  REQUIRE( counts[2] == 0 );
+  for (unsigned int i = 0; i < BrubeckEvent::cardinality; i++)
+    REQUIRE( counts[i] == Approx(dist_vals[i] * steps).epsilon(0.001) );
+}
@@ -0,0 +1,148 @@
+#ifndef AJC_HGUARD_THREAD_POOL
+#define AJC_HGUARD_THREAD_POOL
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+/* ThreadPool
+ *
+ * A fixed set of worker threads which run tasks from a shared queue. This is
+ * used to spread read-only work (e.g. predictions from a trained layer of
+ * viewpoints) across cores.
+ *
+ * parallel_for may be called from inside a task running on the pool: the
+ * calling thread always takes part in the work itself and only waits for
+ * iterations to finish (never for queued helpers to start), so nested calls
+ * can't deadlock even if every worker is busy. If an iteration throws, the
+ * first exception is rethrown in the calling thread once all the iterations
+ * have finished. */
+class ThreadPool {
+private:
+  std::vector<std::thread> workers;
+  std::queue<std::function<void()>> tasks;
+  std::mutex queue_mutex;
+  std::condition_variable queue_cv;
+  bool stopping;
+
+  void worker_loop() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        queue_cv.wait(lock, [this]() { return stopping || !tasks.empty(); });
+        if (stopping && tasks.empty())
+          return;
+
+        task = std::move(tasks.front());
+        tasks.pop();
+      }
+      task();
+    }
+  }
+
+  void enqueue(std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex);
+      tasks.push(std::move(task));
+    }
+    queue_cv.notify_one();
+  }
+
+  // shared between the caller of parallel_for and its helpers, which may
+  // outlive the call if they are only dequeued after all the work is done
+  struct ForState {
+    std::function<void(size_t)> body;
+    size_t n;
+    std::atomic<size_t> next;
+    size_t done;
+    std::mutex done_mutex;
+    std::condition_variable done_cv;
+    std::exception_ptr error; // guarded by done_mutex
+
+    ForState(std::function<void(size_t)> f, size_t count) :
+      body(f), n(count), next(0), done(0) {}
+
+    void run() {
+      size_t finished = 0;
+      for (size_t i = next++; i < n; i = next++) {
+        try {
+          body(i);
+        }
+        catch (...) {
+          std::lock_guard<std::mutex> lock(done_mutex);
+          if (!error)
+            error = std::current_exception();
+        }
+        finished++;
+      }
+
+      if (finished > 0) {
+        std::lock_guard<std::mutex> lock(done_mutex);
+        done += finished;
+        if (done == n)
+          done_cv.notify_all();
+      }
+    }
+  };
+
+public:
+  explicit ThreadPool(unsigned int num_threads) : stopping(false) {
+    for (unsigned int i = 0; i < num_threads; i++)
+      workers.emplace_back(&ThreadPool::worker_loop, this);
+  }
+
+  ThreadPool() : ThreadPool(std::max(1u, std::thread::hardware_concurrency())) {}
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex);
+      stopping = true;
+    }
+    queue_cv.notify_all();
+    for (auto &w : workers)
+      w.join();
+  }
+
+  unsigned int size() const { return workers.size(); }
+
+  template<class F>
+  std::future<typename std::result_of<F()>::type> submit(F f) {
+    using R = typename std::result_of<F()>::type;
+    auto task = std::make_shared<std::packaged_task<R()>>(f);
+    auto result = task->get_future();
+    enqueue([task]() { (*task)(); });
+    return result;
+  }
+
+  // runs body(i) for each i in [0,n), returning once all calls have finished
+  void parallel_for(size_t n, std::function<void(size_t)> body) {
+    if (n == 0)
+      return;
+
+    auto state = std::make_shared<ForState>(body, n);
+    auto num_helpers = std::min<size_t>(workers.size(), n - 1);
+    for (size_t i = 0; i < num_helpers; i++)
+      enqueue([state]() { state->run(); });
+
+    state->run();
+
+    std::unique_lock<std::mutex> lock(state->done_mutex);
+    state->done_cv.wait(lock, [&state]() { return state->done == state->n; });
+    if (state->error)
+      std::rethrow_exception(state->error);
+  }
+};
+
+#endif
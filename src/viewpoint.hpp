@@ -2,16 +2,35 @@
 #define AJC_HGUARD_VIEWPOINT
 
 #include "sequence_model.hpp"
+#include <memory>
 #include <type_traits>
 
 #define DEFAULT_HIST 3
 
+struct ViewpointPredictionException : public std::runtime_error {
+  ViewpointPredictionException(std::string msg) : 
+    std::runtime_error(msg) {}
+};
+
+/* PredictorCursor
+ *
+ * State that a predictor keeps between predictions along a sequence, i.e. on a
+ * context which grows one event at a time (see Predictor::make_cursor). */
+struct PredictorCursor {
+  virtual ~PredictorCursor() {}
+};
+
 /* Predictor
  *
  * The fully abstract interface implemented by all viewpoints */
 template<class EventStructure, class T_predict>
 class Predictor {
 public:
+  // cache of lifted features for a sequence of EventStructures, this allows
+  // all of the predictors in a system to share lifted types (see e.g.
+  // ChoraleFeatures)
+  using Features = typename EventStructure::Features;
+
   virtual EventDistribution<T_predict> 
     predict(const std::vector<EventStructure> &es) const = 0;
   
@@ -21,6 +40,45 @@ public:
   virtual void
     learn_from_tail(const std::vector<EventStructure> &es) = 0;
 
+  // takes back a sequence that was previously learned with learn
+  virtual void
+    unlearn(const std::vector<EventStructure> &es) = 0;
+
+  // predictors which don't make use of the cached features can just fall back
+  // to using the underlying events
+  virtual EventDistribution<T_predict>
+    predict(const Features &fs) const { return predict(fs.events()); }
+
+  virtual void
+    learn(const Features &fs) { learn(fs.events()); }
+
+  virtual void
+    learn_from_tail(const Features &fs) { learn_from_tail(fs.events()); }
+
+  virtual void
+    unlearn(const Features &fs) { unlearn(fs.events()); }
+
+  // status-returning version of predict: the result is empty (instead of an
+  // exception being thrown) if the predictor can't predict in this context
+  virtual Prediction<T_predict>
+  try_predict(const Features &fs) const {
+    if (!can_predict(fs.events()))
+      return Prediction<T_predict>();
+    return predict(fs);
+  }
+
+  // a cursor which can be passed to try_predict_at with each successive
+  // context along a sequence, so that the predictor doesn't have to start from
+  // scratch every time. cursors belong to a single predictor (and thread).
+  virtual std::unique_ptr<PredictorCursor> make_cursor() const {
+    return nullptr;
+  }
+
+  virtual Prediction<T_predict>
+  try_predict_at(const Features &fs, PredictorCursor *) const {
+    return try_predict(fs);
+  }
+
   virtual void
     set_history(unsigned int h) = 0;
 
@@ -30,6 +88,19 @@ public:
   virtual void
     reset() = 0; // undoes any training (useful for short-term models)
 
+  // takes training back to an earlier point (e.g. in a short-term model while
+  // trying out continuations of a piece) without resetting and retraining. a
+  // mark from checkpoint can be passed to rollback until reset or
+  // release_checkpoints is called (see ContextModel::checkpoint).
+  virtual size_t checkpoint() = 0;
+  virtual void rollback(size_t mark) = 0;
+  virtual void release_checkpoints() = 0;
+
+  // predictors backed by a context model can cache the distributions they
+  // compute for recent contexts (see SequenceModel::set_cache_capacity)
+  virtual void set_cache_capacity(size_t) {}
+  virtual SuccessorCacheStats cache_stats() const { return {0, 0}; }
+
   virtual bool 
     can_predict(const std::vector<EventStructure> &es) const = 0;
 
@@ -38,6 +109,15 @@ public:
   virtual Predictor *clone() const = 0;
 
   virtual ~Predictor();
+
+protected:
+  // for predictors which implement try_predict, the throwing interface
+  EventDistribution<T_predict> expect_prediction(const Features &fs) const {
+    auto result = try_predict(fs);
+    if (!result) 
+      throw ViewpointPredictionException(vp_name() + " can't predict context");
+    return *result;
+  }
 };
 
 template<class ES, class T>
@@ -107,17 +187,74 @@ using SurfaceType = template_magic::SurfaceType<T>;
 template<class EventStructure, class T_viewpoint, class T_predict> 
 class Viewpoint : public Predictor<EventStructure, T_predict> {
 protected:
+  using Features = typename EventStructure::Features;
+
   SequenceModel<T_viewpoint> model;
 
   virtual std::vector<T_viewpoint> 
     lift(const std::vector<EventStructure> &events) const = 0; 
 
+  // lifts (at most) the last n events of a context directly to their encoded
+  // form. viewpoints on types which are cached in Features should override
+  // this to avoid lifting the whole context.
+  virtual std::vector<unsigned int>
+  lift_tail(const Features &fs, size_t n) const {
+    auto lifted = lift(fs.events());
+    auto len = std::min(n, lifted.size());
+    std::vector<unsigned int> result(len);
+    std::transform(lifted.end() - len, lifted.end(), result.begin(),
+        [](const T_viewpoint &e) { return e.encode(); });
+    return result;
+  }
+
+  // the context model only looks at the last (h-1) events of a context in
+  // order to predict the next one
+  std::vector<unsigned int> context_codes(const Features &fs) const {
+    auto h = model.get_history();
+    return lift_tail(fs, (h > 0) ? h - 1 : 0);
+  }
+
+  struct ModelCursor : public PredictorCursor {
+    typename SequenceModel<T_viewpoint>::Cursor position;
+    explicit ModelCursor(const SequenceModel<T_viewpoint> &m) : 
+      position(m.cursor()) {}
+  };
+
+  // the model's successors in the context, using the cursor (from make_cursor)
+  // to match the context if we have one
+  void context_successors(const Features &fs, PredictorCursor *cursor,
+                          SparseSuccessors &result) const {
+    if (cursor == nullptr) {
+      model.gen_successors(context_codes(fs), result);
+      return;
+    }
+
+    auto &position = static_cast<ModelCursor *>(cursor)->position;
+    position.follow(context_codes(fs));
+    model.gen_successors(position, result);
+  }
+
 public:
   void reset() override { model.clear_model(); }
+  size_t checkpoint() override { return model.checkpoint(); }
+  void rollback(size_t mark) override { model.rollback(mark); }
+  void release_checkpoints() override { model.release_checkpoints(); }
   void set_history(unsigned int h) override { model.set_history(h); }
   unsigned int get_history() const override { return model.get_history(); }
   void write_latex(std::string filename) const { model.write_latex(filename); }
 
+  void set_cache_capacity(size_t capacity) override {
+    model.set_cache_capacity(capacity);
+  }
+
+  SuccessorCacheStats cache_stats() const override {
+    return model.cache_stats();
+  }
+
+  std::unique_ptr<PredictorCursor> make_cursor() const override {
+    return std::unique_ptr<PredictorCursor>(new ModelCursor(model));
+  }
+
   void learn(const std::vector<EventStructure> &events) override {
     model.learn_sequence(lift(events));
   }
@@ -128,6 +265,24 @@ public:
       model.update_from_tail(lifted);
   }
 
+  void learn(const Features &fs) override {
+    model.learn_encoded(lift_tail(fs, fs.size()));
+  }
+
+  void unlearn(const std::vector<EventStructure> &events) override {
+    model.unlearn_sequence(lift(events));
+  }
+
+  void unlearn(const Features &fs) override {
+    model.unlearn_encoded(lift_tail(fs, fs.size()));
+  }
+
+  void learn_from_tail(const Features &fs) override {
+    auto lifted = lift_tail(fs, model.get_history());
+    if (lifted.size() > 0)
+      model.update_from_encoded_tail(lifted);
+  }
+
   Viewpoint(unsigned int history) : model(history) {}
 };
 
@@ -163,6 +318,7 @@ protected:
   using T_surface = SurfaceType<T_viewpoint>;
   using Base = GenVPBase<EventStructure, T_viewpoint>;
   using PredBase = Predictor<EventStructure, T_surface>;
+  using Features = typename Base::Features;
 
 public:
   std::vector<T_viewpoint> 
@@ -170,13 +326,36 @@ public:
     return EventStructure::template lift<T_viewpoint>(events);
   }
 
+  std::vector<unsigned int>
+  lift_tail(const Features &fs, size_t n) const override {
+    auto tail = fs.template column<T_viewpoint>().tail(n);
+    return std::vector<unsigned int>(tail.begin(), tail.end());
+  }
+
   EventDistribution<T_surface> 
-  predict(const std::vector<EventStructure> &ctx) const override {
-    auto lifted = EventStructure::template lift<T_viewpoint>(ctx);
-    auto hidden_dist = this->model.gen_successor_dist(lifted);
+  predict(const Features &ctx) const override {
+    return this->expect_prediction(ctx);
+  }
+
+  Prediction<T_surface>
+  try_predict(const Features &ctx) const override {
+    return try_predict_at(ctx, nullptr);
+  }
+
+  Prediction<T_surface>
+  try_predict_at(const Features &ctx, PredictorCursor *cursor) const override {
+    SparseSuccessors succ;
+    this->context_successors(ctx, cursor, succ);
+    auto hidden_dist = EventDistribution<T_viewpoint>(
+      SequenceModel<T_viewpoint>::expand_successors(succ));
     return EventStructure::reify(ctx, hidden_dist);
   }
 
+  EventDistribution<T_surface> 
+  predict(const std::vector<EventStructure> &ctx) const override {
+    return predict(Features(ctx));
+  }
+
   bool can_predict(const std::vector<EventStructure> &) const override {
     // TODO: once all VPs have been replaced with GeneralViewpoints, this method
     // can go and we will switch to an exception-based approach to this
@@ -207,6 +386,7 @@ protected:
   using T_surface = SurfaceType<T_predict>;
   using Base = GenLinkedBase<EventStructure, T_hidden, T_predict>;
   using PredBase = Predictor<EventStructure, T_surface>;
+  using Features = typename Base::Features;
 
 public:
   std::vector<T_pair>
@@ -218,17 +398,35 @@ public:
     return T_pair::zip_tail(left, right);
   }
 
+  std::vector<unsigned int>
+  lift_tail(const Features &fs, size_t n) const override {
+    return T_pair::zip_tail_codes(fs.template column<T_hidden>(),
+                                  fs.template column<T_predict>(), n);
+  }
+
   EventDistribution<T_surface>
   predict(const std::vector<EventStructure> &ctx) const override {
-    auto lifted = lift(ctx);
-    auto pair_dist = this->model.gen_successor_dist(lifted);
-    std::array<double, T_predict::cardinality> predict_values{{0.0}};
-    for (auto e_predict : EventEnumerator<T_predict>())
-      for (auto e_hidden : EventEnumerator<T_hidden>()) {
-        T_pair pair(e_hidden, e_predict);
-        predict_values[e_predict.encode()] += pair_dist.probability_for(pair);
-      }
+    return predict(Features(ctx));
+  }
+
+  EventDistribution<T_surface>
+  predict(const Features &ctx) const override {
+    return this->expect_prediction(ctx);
+  }
 
+  Prediction<T_surface>
+  try_predict(const Features &ctx) const override {
+    return try_predict_at(ctx, nullptr);
+  }
+
+  Prediction<T_surface>
+  try_predict_at(const Features &ctx, PredictorCursor *cursor) const override {
+    // the joint distribution is never expanded: we sum out the hidden type
+    // from the pairs that have actually been observed, and account for the
+    // rest with the escape mass they share
+    SparseSuccessors joint;
+    this->context_successors(ctx, cursor, joint);
+    auto predict_values = T_pair::marginalise_left(joint.seen, joint.unseen);
     auto derived_dist = EventDistribution<T_predict>(predict_values);
     return EventStructure::reify(ctx, derived_dist);
   }
@@ -268,6 +466,7 @@ protected:
   using T_surface = SurfaceType<T_predict>;
   using Base = TripleLinkedBase<EventStructure, T_hleft, T_hright, T_predict>;
   using PredBase = Predictor<EventStructure, T_surface>;
+  using Features = typename Base::Features;
 
 public:
   std::vector<T_model>
@@ -279,17 +478,38 @@ public:
     return T_model::zip_tail(hidden_es, main_es);
   }
 
+  std::vector<unsigned int>
+  lift_tail(const Features &fs, size_t n) const override {
+    // we take one more event than we need on each side so that the lengths
+    // still differ by at most one (see EventPair::zip_tail)
+    auto hidden_es = T_hidden::zip_tail_codes(fs.template column<T_hleft>(),
+                                              fs.template column<T_hright>(),
+                                              n + 1);
+    auto predict_es = fs.template column<T_predict>().tail(n + 1);
+    return T_model::zip_tail_codes(hidden_es, predict_es, n);
+  }
+
   EventDistribution<T_surface>
   predict(const std::vector<EventStructure> &ctx) const override {
-    auto lifted = lift(ctx);
-    auto triple_dist = this->model.gen_successor_dist(lifted);
-    std::array<double, T_predict::cardinality> summed_out{{0.0}};
-    for (auto e_predict : EventEnumerator<T_predict>())
-      for(auto e_hidden : EventEnumerator<T_hidden>()) {
-        T_model pair(e_hidden, e_predict);
-        summed_out[e_predict.encode()] += triple_dist.probability_for(pair);
-      }
+    return predict(Features(ctx));
+  }
 
+  EventDistribution<T_surface>
+  predict(const Features &ctx) const override {
+    return this->expect_prediction(ctx);
+  }
+
+  Prediction<T_surface>
+  try_predict(const Features &ctx) const override {
+    return try_predict_at(ctx, nullptr);
+  }
+
+  Prediction<T_surface>
+  try_predict_at(const Features &ctx, PredictorCursor *cursor) const override {
+    // as in GeneralLinkedVP, the pair of hidden types is summed out directly
+    SparseSuccessors joint;
+    this->context_successors(ctx, cursor, joint);
+    auto summed_out = T_model::marginalise_left(joint.seen, joint.unseen);
     auto derived_dist = EventDistribution<T_predict>(summed_out);
     return EventStructure::reify(ctx, derived_dist);
   }
@@ -331,16 +551,16 @@ public:
 
   EventDistribution<T_predict> 
   predict(const std::vector<EventStructure> &ctx) const override {
-    // generate the joint distribution
-    auto dist = this->model.gen_successor_dist(lift(ctx));
-    
-    // then marginalise (sum over the hidden type)
-    std::array<double, T_predict::cardinality> values{{0.0}};
-    for (auto e_predict : EventEnumerator<T_predict>())
-      for (auto e_hidden : EventEnumerator<T_hidden>()) {
-        EventPair<T_hidden, T_predict> pair(e_hidden, e_predict);
-        values[e_predict.encode()] += dist.probability_for(pair);
-      }
+    std::vector<unsigned int> context;
+    for (const auto &pair : lift(ctx))
+      context.push_back(pair.encode());
+
+    // generate the (sparse) joint distribution, then marginalise (sum over the
+    // hidden type)
+    SparseSuccessors joint;
+    this->model.gen_successors(context, joint);
+    auto values = 
+      EventPair<T_hidden, T_predict>::marginalise_left(joint.seen, joint.unseen);
 
     return EventDistribution<T_predict>(values);
   }
@@ -403,9 +623,4 @@ predict(const std::vector<EventStructure> &context) const {
     this->model.gen_successor_dist(EventStructure::template lift<T>(context));
 }
 
-struct ViewpointPredictionException : public std::runtime_error {
-  ViewpointPredictionException(std::string msg) : 
-    std::runtime_error(msg) {}
-};
-
 #endif
@@ -16,6 +16,26 @@ xoroshiro128plus_engine::operator()() {
   return result;
 }
 
+void xoroshiro128plus_engine::jump() {
+  static const uint64_t jump_poly[] = 
+    { 0xbeac0467eba5facb, 0xd86b048b86aa9922 };
+
+  uint64_t s0 = 0;
+  uint64_t s1 = 0;
+  for (auto word : jump_poly) {
+    for (int b = 0; b < 64; b++) {
+      if (word & ((uint64_t)1 << b)) {
+        s0 ^= state[0];
+        s1 ^= state[1];
+      }
+      (*this)();
+    }
+  }
+
+  state[0] = s0;
+  state[1] = s1;
+}
+
 void xoroshiro128plus_engine::warm_up() {
   (*this)();
   (*this)();
@@ -27,6 +27,10 @@ public:
   void seed(std::function<uint32_t(void)>);
   void seed_long(std::function<uint64_t(void)>);
   void seed(const std::array<uint32_t, 4> &);
+
+  // advances the engine by 2^64 steps. jumping copies of an engine repeatedly
+  // gives non-overlapping streams, e.g. for parallel generation.
+  void jump();
 };
 
 #endif